@@ -0,0 +1,50 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+// A block of memory which objects are allocated from in order.
+struct arena_block {
+	struct arena_block *prev; // earlier blocks, kept reachable until exit
+	size_t size;
+	size_t used;
+	_Alignas(max_align_t) char data[];
+};
+
+// Allocates zeroed memory of the given size and alignment, or returns NULL.
+// Requests which do not fit in the current block start a new one, so the
+// memory of earlier blocks never moves.
+void *arena_alloc(struct arena *arena, size_t size, size_t align) {
+	struct arena_block *block = arena->block;
+	size_t offset = 0;
+	if (block) {
+		offset = (block->used + align - 1) & ~(align - 1);
+	}
+	if (!block || offset + size > block->size) {
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = calloc(1, sizeof *block + block_size);
+		if (!block) {
+			return NULL;
+		}
+		block->prev = arena->block;
+		block->size = block_size;
+		arena->block = block;
+		offset = 0;
+	}
+	block->used = offset + size;
+	return block->data + offset;
+}
+
+// Copies at most n bytes of the string into the arena.
+char *arena_strndup(struct arena *arena, const char *s, size_t n) {
+	size_t len = strnlen(s, n);
+	char *copy = arena_alloc(arena, len + 1, 1);
+	if (copy) {
+		memcpy(copy, s, len);
+	}
+	return copy;
+}
@@ -0,0 +1,16 @@
+#ifndef WMENU_ARENA_H
+#define WMENU_ARENA_H
+
+#include <stddef.h>
+
+struct arena_block;
+
+// An allocator for many small objects which live until exit.
+struct arena {
+	struct arena_block *block; // block being allocated from
+};
+
+void *arena_alloc(struct arena *arena, size_t size, size_t align);
+char *arena_strndup(struct arena *arena, const char *s, size_t n);
+
+#endif
@@ -0,0 +1,97 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fuzzy.h"
+
+#include "search.h"
+
+#define SCORE_MATCH 16
+#define SCORE_GAP_START -3
+#define SCORE_GAP_EXTENSION -1
+#define BONUS_BOUNDARY 8
+#define BONUS_CAMEL 7
+#define BONUS_CONSECUTIVE 4
+
+static bool is_alnum(char c) {
+	return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z')
+		|| ('0' <= c && c <= '9') || (c & 0x80);
+}
+
+// Returns the bonus for matching the character at position i, which is
+// higher at the start of words.
+static int bonus(const char *text, size_t i) {
+	if (!is_alnum(text[i])) {
+		return 0;
+	}
+	if (i == 0 || !is_alnum(text[i - 1])) {
+		return BONUS_BOUNDARY;
+	}
+	if ('a' <= text[i - 1] && text[i - 1] <= 'z' && 'A' <= text[i] && text[i] <= 'Z') {
+		return BONUS_CAMEL;
+	}
+	return 0;
+}
+
+static bool equal(char c, char p, bool fold_case) {
+	return (fold_case ? fold(c) : c) == p;
+}
+
+// Returns whether the characters of the pattern occur in order in the text,
+// and scores the shortest such occurrence ending at the earliest position.
+// Matches at the start of words and consecutive matches score higher, and
+// gaps between matches score lower. With fold, the pattern must be lowercase.
+bool fuzzy_match(const char *text, size_t text_len,
+		const char *pattern, size_t pattern_len, bool fold_case, int *score) {
+	/* find the end of the first occurrence */
+	size_t end = 0, j = 0;
+	for (; end < text_len && j < pattern_len; end++) {
+		if (equal(text[end], pattern[j], fold_case)) {
+			j++;
+		}
+	}
+	if (j < pattern_len) {
+		return false;
+	}
+
+	/* go back to the latest start of an occurrence ending there */
+	size_t start = end;
+	while (j > 0) {
+		start--;
+		if (equal(text[start], pattern[j - 1], fold_case)) {
+			j--;
+		}
+	}
+
+	*score = 0;
+	bool consecutive = false, gap = false;
+	for (size_t i = start; i < end; i++) {
+		if (j < pattern_len && equal(text[i], pattern[j], fold_case)) {
+			int b = bonus(text, i);
+			*score += SCORE_MATCH + (j == 0 ? 2 * b : b);
+			if (consecutive) {
+				*score += BONUS_CONSECUTIVE;
+			}
+			consecutive = true;
+			gap = false;
+			j++;
+		} else {
+			*score += gap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+			consecutive = false;
+			gap = true;
+		}
+	}
+	return true;
+}
+
+// Returns whether the characters of s occur in order in t.
+bool is_subsequence(const char *s, const char *t) {
+	for (; *s; s++, t++) {
+		while (*t && *t != *s) {
+			t++;
+		}
+		if (!*t) {
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,11 @@
+#ifndef WMENU_FUZZY_H
+#define WMENU_FUZZY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+bool fuzzy_match(const char *text, size_t text_len,
+		const char *pattern, size_t pattern_len, bool fold_case, int *score);
+bool is_subsequence(const char *s, const char *t);
+
+#endif
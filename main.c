@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <signal.h>
 #include <stdio.h>
@@ -292,19 +293,29 @@ int main(int argc, char *argv[]) {
 	keyboard_init(keyboard, menu);
 	menu->keyboard = keyboard;
 
+	pthread_mutex_lock(&menu->lock);
 	create_surface(menu);
 	render_menu(menu);
-
-	read_menu_items(menu);
-	render_menu(menu);
+	calc_widths(menu);
+	schedule_frame(menu);
 
 	struct pollfd fds[] = {
 		{ wl_display_get_fd(menu->display), POLLIN },
 		{ keyboard->repeat_timer, POLLIN },
+		{ menu->event, POLLIN },
+		{ STDIN_FILENO, POLLIN },
 	};
 	const size_t nfds = sizeof(fds) / sizeof(*fds);
 
 	while (!menu->exit) {
+		/* match the input once per batch of events */
+		match_items(menu);
+
+		/* draw at most one frame per frame callback */
+		if (menu->dirty && !menu->frame_callback) {
+			render_menu(menu);
+		}
+
 		errno = 0;
 		do {
 			if (wl_display_flush(menu->display) == -1 && errno != EAGAIN) {
@@ -313,7 +324,11 @@ int main(int argc, char *argv[]) {
 			}
 		} while (errno == EAGAIN);
 
-		if (poll(fds, nfds, -1) < 0) {
+		/* let the matching thread publish matches while polling */
+		pthread_mutex_unlock(&menu->lock);
+		int ready = poll(fds, nfds, -1);
+		pthread_mutex_lock(&menu->lock);
+		if (ready < 0) {
 			fprintf(stderr, "poll: %s\n", strerror(errno));
 			break;
 		}
@@ -322,13 +337,37 @@ int main(int argc, char *argv[]) {
 			if (wl_display_dispatch(menu->display) < 0) {
 				menu->exit = true;
 			}
+			/* a buffer may have been released */
+			render_pending(menu);
 		}
 
 		if (fds[1].revents & POLLIN) {
 			keyboard_repeat(keyboard);
 		}
+
+		if (fds[2].revents & POLLIN) {
+			uint64_t published;
+			if (read(menu->event, &published, sizeof published) > 0) {
+				schedule_frame(menu);
+			}
+		}
+
+		if (fds[3].revents & (POLLNVAL | POLLERR)) {
+			/* standard input is not open or failed, so it ends here */
+			menu->eof = true;
+			pthread_cond_broadcast(&menu->cond);
+			fds[3].fd = -1;
+		} else if (fds[3].revents & (POLLIN | POLLHUP)) {
+			if (!read_menu_items(menu)) {
+				/* stop polling standard input once it is closed */
+				fds[3].fd = -1;
+			}
+		}
 	}
 
+	free_strips(menu);
+	destroy_buffer(&menu->buffers[0]);
+	destroy_buffer(&menu->buffers[1]);
 	wl_display_disconnect(menu->display);
 
 	if (menu->failure) {
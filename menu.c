@@ -1,6 +1,9 @@
 #define _POSIX_C_SOURCE 200809L
 #include <ctype.h>
+#include <errno.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <signal.h>
 #include <stdio.h>
@@ -9,7 +12,9 @@
 #include <strings.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/timerfd.h>
 #include <wayland-client.h>
 #include <wayland-client-protocol.h>
@@ -17,8 +22,45 @@
 
 #include "menu.h"
 
+#include "arena.h"
+#include "fuzzy.h"
 #include "pango.h"
 #include "render.h"
+#include "search.h"
+#include "thread-pool.h"
+#include "trigram.h"
+
+// Number of items from which matching is split across threads
+#ifndef PARALLEL_MATCH_ITEMS
+#define PARALLEL_MATCH_ITEMS 16384
+#endif
+
+// Number of items from which a trigram index is built for matching
+#ifndef TRIGRAM_INDEX_ITEMS
+#define TRIGRAM_INDEX_ITEMS 65536
+#endif
+
+// Number of best fuzzy matches which are listed
+#ifndef FUZZY_MATCH_ITEMS
+#define FUZZY_MATCH_ITEMS 1024
+#endif
+
+// Number of items matched between checks for a newer input
+#ifndef MATCH_SLICE_ITEMS
+#define MATCH_SLICE_ITEMS 65536
+#endif
+
+// Number of bytes read from standard input at a time
+#ifndef READ_SIZE
+#define READ_SIZE 65536
+#endif
+
+// Most memory the matching items of the snapshots above the first may take
+#ifndef SNAPSHOT_BYTES
+#define SNAPSHOT_BYTES (64 << 20)
+#endif
+
+static void start_matching(struct menu *menu);
 
 static bool parse_color(const char *color, uint32_t *result) {
 	if (color[0] == '#') {
@@ -37,20 +79,21 @@ static bool parse_color(const char *color, uint32_t *result) {
 	return true;
 }
 
-int strnsmartcasecmp(const char *s1, const char *s2, size_t n) {
-	const char *c;
-	for (c = s2; *c; c++) {
-		if ('A' <= *c && *c <= 'Z')
-			return strncmp(s1, s2, n);
-	}
-	return strncasecmp(s1, s2, n);
-}
-
 // Initialize the menu.
 void menu_init(struct menu *menu, int argc, char *argv[]) {
 	char buf[128];
 
-	menu->strncmp = strncmp;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	menu->threads = threads > 0 ? threads : 1;
+	menu->thread_pool = thread_pool_create();
+	pthread_mutex_init(&menu->lock, NULL);
+	pthread_cond_init(&menu->cond, NULL);
+	atomic_init(&menu->generation, 0);
+	menu->event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (menu->event == -1) {
+		fprintf(stderr, "could not create eventfd\n");
+		exit(EXIT_FAILURE);
+	}
 	menu->font = "hack 10";
 	menu->background = 0x222222ff;
 	menu->foreground = 0xbbbbbbff;
@@ -60,17 +103,20 @@ void menu_init(struct menu *menu, int argc, char *argv[]) {
 	menu->selectionfg = 0xeeeeeeff;
 
 	const char *usage =
-		"Usage: wmenu [-biv] [-f font] [-l lines] [-o output] [-p prompt]\n"
+		"Usage: wmenu [-bFiv] [-f font] [-l lines] [-o output] [-p prompt]\n"
 		"\t[-N color] [-n color] [-M color] [-m color] [-S color] [-s color]\n";
 
 	int opt;
-	while ((opt = getopt(argc, argv, "bhivf:l:o:p:N:n:M:m:S:s:")) != -1) {
+	while ((opt = getopt(argc, argv, "bFhivf:l:o:p:N:n:M:m:S:s:")) != -1) {
 		switch (opt) {
 		case 'b':
 			menu->bottom = true;
 			break;
+		case 'F':
+			menu->fuzzy = true;
+			break;
 		case 'i':
-			menu->strncmp = strnsmartcasecmp;
+			menu->insensitive = true;
 			break;
 		case 'v':
 			puts("wmenu " VERSION);
@@ -142,195 +188,1172 @@ void menu_init(struct menu *menu, int argc, char *argv[]) {
 		menu->height += menu->height * menu->lines;
 	}
 	menu->padding = height / 2;
+
+	menu->matches = NO_ITEM;
+	menu->matches_end = NO_ITEM;
+	menu->sel = NO_ITEM;
+	start_matching(menu);
 }
 
-static void append_page(struct page *page, struct page **first, struct page **last) {
-	if (*last) {
-		(*last)->next = page;
-	} else {
-		*first = page;
+// Starts a new page with the given item.
+static struct page *append_page(struct menu *menu, uint32_t first) {
+	if (menu->npages == menu->pages_size) {
+		size_t size = MAX(2 * menu->pages_size, 16);
+		struct page *pages = realloc(menu->pages, size * sizeof *pages);
+		if (!pages) {
+			fprintf(stderr, "could not realloc %zu bytes", size * sizeof *pages);
+			exit(EXIT_FAILURE);
+		}
+		menu->pages = pages;
+		menu->pages_size = size;
 	}
-	page->prev = *last;
-	page->next = NULL;
-	*last = page;
+	struct page *page = &menu->pages[menu->npages++];
+	page->first = first;
+	page->last = first;
+	return page;
 }
 
-static void page_items(struct menu *menu) {
-	// Free existing pages
-	while (menu->pages != NULL) {
-		struct page *page = menu->pages;
-		menu->pages = menu->pages->next;
-		free(page);
+// Measures the unmeasured matches from the first unpaged one up to the
+// given one at once, so that paging far ahead can measure them in parallel.
+static void measure_matches(struct menu *menu, uint32_t until) {
+	struct items *items = &menu->items;
+	size_t len = 0;
+	for (uint32_t item = menu->unpaged; item != NO_ITEM; item = items->next_match[item]) {
+		if (items->width[item] < 0) {
+			len++;
+		}
+		if (item == until) {
+			break;
+		}
+	}
+	if (len == 0) {
+		return;
 	}
 
-	if (!menu->matches) {
+	uint32_t *pending = malloc(len * sizeof *pending);
+	if (!pending) {
+		/* measured one by one while paging */
 		return;
 	}
+	len = 0;
+	for (uint32_t item = menu->unpaged; item != NO_ITEM; item = items->next_match[item]) {
+		if (items->width[item] < 0) {
+			pending[len++] = item;
+		}
+		if (item == until) {
+			break;
+		}
+	}
+	measure_items(menu, pending, len);
+	free(pending);
+}
 
-	// Make new pages
-	if (menu->lines > 0) {
-		struct page *pages_end = NULL;
-		struct item *item = menu->matches;
-		while (item) {
-			struct page *page = calloc(1, sizeof(struct page));
-			page->first = item;
-
-			for (int i = 1; item && i <= menu->lines; i++) {
-				item->page = page;
+// Pages the matching items up to the given one. Pages are made only as far as
+// they are needed, so that items are measured only once they are paged.
+static void page_items(struct menu *menu, uint32_t until) {
+	struct items *items = &menu->items;
+
+	if (menu->lines <= 0 && menu->unpaged != NO_ITEM && items->page[until] == NO_ITEM) {
+		measure_matches(menu, until);
+	}
+	while (menu->unpaged != NO_ITEM && items->page[until] == NO_ITEM) {
+		uint32_t item = menu->unpaged;
+		struct page *page = append_page(menu, item);
+
+		if (menu->lines > 0) {
+			for (int i = 1; item != NO_ITEM && i <= menu->lines; i++) {
+				items->page[item] = menu->npages - 1;
 				page->last = item;
-				item = item->next_match;
+				item = items->next_match[item];
 			}
-			append_page(page, &menu->pages, &pages_end);
-		}
-	} else {
-		// Calculate available space
-		int max_width = menu->width - menu->inputw - menu->promptw
-			- menu->left_arrow - menu->right_arrow;
-
-		struct page *pages_end = NULL;
-		struct item *item = menu->matches;
-		while (item) {
-			struct page *page = calloc(1, sizeof(struct page));
-			page->first = item;
+		} else {
+			// Calculate available space
+			int max_width = menu->width - menu->inputw - menu->promptw
+				- menu->left_arrow - menu->right_arrow;
 
 			int total_width = 0;
-			while (item) {
-				total_width += item->width + 2 * menu->padding;
-				if (total_width > max_width) {
+			while (item != NO_ITEM) {
+				total_width += item_width(menu, item) + 2 * menu->padding;
+				// An item wider than the page gets a page of its own
+				if (total_width > max_width && item != page->first) {
 					break;
 				}
 
-				item->page = page;
+				items->page[item] = menu->npages - 1;
 				page->last = item;
-				item = item->next_match;
+				item = items->next_match[item];
 			}
-			append_page(page, &menu->pages, &pages_end);
 		}
+		menu->unpaged = item;
 	}
 }
 
-static const char *fstrstr(struct menu *menu, const char *s, const char *sub) {
-	for (size_t len = strlen(sub); *s; s++) {
-		if (!menu->strncmp(s, sub, len)) {
-			return s;
+// A token of the input.
+struct token {
+	const char *text;
+	size_t len;
+	bool fold; // match case-insensitively
+};
+
+static bool has_upper(const char *s, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		if ('A' <= s[i] && s[i] <= 'Z') {
+			return true;
 		}
 	}
-	return NULL;
+	return false;
+}
+
+// Makes a token from the given text. With -i, tokens without uppercase letters
+// are matched case-insensitively.
+static struct token make_token(struct menu *menu, const char *text, size_t len) {
+	struct token tok = { text, len, false };
+	tok.fold = menu->insensitive && !has_upper(text, len);
+	return tok;
 }
 
-static void append_item(struct item *item, struct item **first, struct item **last) {
-	if (*last) {
-		(*last)->next_match = item;
+// Returns whether the item text starts with the token, or is the token if
+// whole is set. Item texts need not be NUL-terminated.
+static bool item_starts_with(struct items *items, uint32_t item,
+		struct token *tok, bool whole) {
+	size_t len = items->text_len[item];
+	if (len < tok->len || (whole && len != tok->len)) {
+		return false;
+	}
+	if (!tok->fold) {
+		return memcmp(items->text[item], tok->text, tok->len) == 0;
+	}
+	if (items->folded[item]) {
+		return memcmp(items->folded[item], tok->text, tok->len) == 0;
+	}
+	return strncasecmp(items->text[item], tok->text, tok->len) == 0;
+}
+
+static const char *fstrstr(struct items *items, uint32_t item, struct token *tok) {
+	size_t len = items->text_len[item];
+	if (!tok->fold) {
+		return search(items->text[item], len, tok->text, tok->len);
+	}
+	if (items->folded[item]) {
+		return search(items->folded[item], len, tok->text, tok->len);
+	}
+	return search_fold(items->text[item], len, tok->text, tok->len);
+}
+
+static void append_item(struct items *items, uint32_t item,
+		uint32_t *first, uint32_t *last) {
+	if (*last != NO_ITEM) {
+		items->next_match[*last] = item;
 	} else {
 		*first = item;
 	}
-	item->prev_match = *last;
-	item->next_match = NULL;
+	items->prev_match[item] = *last;
+	items->next_match[item] = NO_ITEM;
+	items->page[item] = NO_ITEM;
 	*last = item;
 }
 
-static void match_items(struct menu *menu) {
-	struct item *lexact = NULL, *exactend = NULL;
-	struct item *lprefix = NULL, *prefixend = NULL;
-	struct item *lsubstr  = NULL, *substrend = NULL;
-	char buf[sizeof menu->input], *tok;
-	char **tokv = NULL;
-	int i, tokc = 0;
-	size_t tok_len;
-	menu->matches = NULL;
-	menu->matches_end = NULL;
-	menu->sel = NULL;
+// Returns whether every item matching the old input also matches the new input.
+// This holds when each token of the old input is contained in the new input,
+// since a token without spaces can only occur within a single token.
+// In fuzzy mode, this holds when the old input is a subsequence of the new one.
+static bool input_narrows(struct menu *menu, const char *old, const char *new) {
+	char buf[BUFSIZ], *tok;
 
-	size_t text_len = strlen(menu->input);
+	if (menu->fuzzy) {
+		return is_subsequence(old, new);
+	}
+
+	strcpy(buf, old);
+	for (tok = strtok(buf, " "); tok; tok = strtok(NULL, " ")) {
+		if (!strstr(new, tok)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// The input, split into tokens.
+struct query {
+	char buf[BUFSIZ];
+	struct token input; // the whole input
+	struct token *tokv; // tokens separated by spaces
+	int tokc;
+};
+
+static void parse_query(struct menu *menu, const char *input, struct query *query) {
+	char *tok;
+
+	/* decide the case sensitivity once for the whole input */
+	query->input = make_token(menu, input, strlen(input));
+	query->tokv = NULL;
+	query->tokc = 0;
 
 	/* tokenize text by space for matching the tokens individually */
-	strcpy(buf, menu->input);
-	tok = strtok(buf, " ");
+	strcpy(query->buf, input);
+	tok = strtok(query->buf, " ");
 	while (tok) {
-		tokv = realloc(tokv, (tokc + 1) * sizeof *tokv);
-		if (!tokv) {
+		query->tokv = realloc(query->tokv, (query->tokc + 1) * sizeof *query->tokv);
+		if (!query->tokv) {
 			fprintf(stderr, "could not realloc %zu bytes",
-					(tokc + 1) * sizeof *tokv);
+					(query->tokc + 1) * sizeof *query->tokv);
 			exit(EXIT_FAILURE);
 		}
-		tokv[tokc] = tok;
-		tokc++;
+		query->tokv[query->tokc] = make_token(menu, tok, strlen(tok));
+		query->tokc++;
 		tok = strtok(NULL, " ");
 	}
-	tok_len = tokc ? strlen(tokv[0]) : 0;
+}
+
+// How well an item matches the input.
+enum match_kind {
+	MATCH_EXACT,
+	MATCH_PREFIX,
+	MATCH_SUBSTR,
+};
+
+static unsigned char classify_item(struct query *query, struct items *items,
+		uint32_t item) {
+	if (!query->tokc || item_starts_with(items, item, &query->input, true)) {
+		return MATCH_EXACT;
+	} else if (item_starts_with(items, item, &query->tokv[0], false)) {
+		return MATCH_PREFIX;
+	}
+	return MATCH_SUBSTR;
+}
+
+// Links the matching items into the list of matches, ordering exact matches
+// first, then prefix matches, then substring matches, and pages the first of
+// them.
+static void link_matches(struct menu *menu, uint32_t *items,
+		unsigned char *kinds, size_t len) {
+	menu->matches = NO_ITEM;
+	menu->matches_end = NO_ITEM;
+	menu->sel = NO_ITEM;
+
+	for (int kind = MATCH_EXACT; kind <= MATCH_SUBSTR; kind++) {
+		for (size_t i = 0; i < len; i++) {
+			if (kinds[i] == kind) {
+				append_item(&menu->items, items[i],
+						&menu->matches, &menu->matches_end);
+			}
+		}
+	}
+
+	menu->npages = 0;
+	menu->unpaged = menu->matches;
+	menu->relinks++;
+	menu->sel = menu->matches;
+	if (menu->sel != NO_ITEM) {
+		page_items(menu, menu->sel);
+	}
+}
+
+static uint64_t *alloc_bitset(size_t nwords) {
+	uint64_t *bits = calloc(MAX(nwords, 1), sizeof *bits);
+	if (!bits) {
+		fprintf(stderr, "could not calloc %zu bytes", nwords * sizeof *bits);
+		exit(EXIT_FAILURE);
+	}
+	return bits;
+}
+
+// Sets the bits of all items in a bitset of the given number of items.
+static void fill_bitset(uint64_t *bits, size_t nitems) {
+	memset(bits, 0xff, nitems / 64 * sizeof *bits);
+	if (nitems % 64) {
+		bits[nitems / 64] = ((uint64_t)1 << (nitems % 64)) - 1;
+	}
+}
 
-	struct item *item;
-	for (item = menu->items; item; item = item->next) {
-		for (i = 0; i < tokc; i++) {
-			if (!fstrstr(menu, item->text, tokv[i])) {
-				/* token does not match */
+static void free_token_set(struct token_set *set) {
+	free(set->text);
+	free(set->known);
+	free(set->matches);
+	memset(set, 0, sizeof *set);
+}
+
+// Initializes a new set for the token. Items which cannot contain the token,
+// according to the trigram index or to the sets of tokens contained in it,
+// are marked as known not to match it.
+static void init_token_set(struct menu *menu, struct token_set *set,
+		struct token *tok) {
+	size_t nitems = menu->snapshots[0].len;
+	size_t nwords = (nitems + 63) / 64;
+
+	set->text = strndup(tok->text, tok->len);
+	if (!set->text) {
+		fprintf(stderr, "could not strndup %zu bytes", tok->len + 1);
+		exit(EXIT_FAILURE);
+	}
+	set->fold = tok->fold;
+	set->known = alloc_bitset(nwords);
+	set->matches = alloc_bitset(nwords);
+
+	uint32_t *candidates = NULL;
+	size_t ncandidates = 0;
+	if (menu->index && trigram_index_ready(menu->index)
+			&& trigram_index_narrow(menu->index, tok->text, tok->len,
+				&candidates, &ncandidates)) {
+		fill_bitset(set->known, nitems);
+		for (size_t i = 0; i < ncandidates; i++) {
+			set->known[candidates[i] / 64] &= ~((uint64_t)1 << (candidates[i] % 64));
+		}
+		free(candidates);
+	}
+
+	for (size_t i = 0; i < TOKEN_CACHE_SIZE; i++) {
+		struct token_set *other = &menu->token_sets[i];
+		if (other == set || !other->text || (set->fold && !other->fold)
+				|| !strstr(set->text, other->text)) {
+			continue;
+		}
+		for (size_t w = 0; w < nwords; w++) {
+			set->known[w] |= other->known[w] & ~other->matches[w];
+		}
+	}
+}
+
+// Returns the cached set of items matching the token, creating it if needed.
+// Sets used since the given time are not replaced. If all of them are, a
+// temporary set is initialized instead.
+static struct token_set *get_token_set(struct menu *menu, struct token *tok,
+		unsigned long since, struct token_set *temp) {
+	struct token_set *set = NULL;
+	for (size_t i = 0; i < TOKEN_CACHE_SIZE; i++) {
+		struct token_set *entry = &menu->token_sets[i];
+		if (entry->text && entry->fold == tok->fold
+				&& strlen(entry->text) == tok->len
+				&& memcmp(entry->text, tok->text, tok->len) == 0) {
+			entry->used = ++menu->token_clock;
+			return entry;
+		}
+		if (entry->used <= since && (!set || entry->used < set->used)) {
+			set = entry;
+		}
+	}
+
+	if (!set) {
+		set = temp;
+	}
+	free_token_set(set);
+	init_token_set(menu, set, tok);
+	set->used = ++menu->token_clock;
+	return set;
+}
+
+// Returns whether the item matches the query.
+static bool item_matches(struct menu *menu, struct query *query, uint32_t item) {
+	struct items *items = &menu->items;
+	if (menu->fuzzy && query->input.len > 0) {
+		int score;
+		return fuzzy_match(items->text[item], items->text_len[item],
+				query->input.text, query->input.len, query->input.fold, &score);
+	}
+	for (int i = 0; i < query->tokc; i++) {
+		if (!fstrstr(items, item, &query->tokv[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// A fuzzy match and its score.
+struct ranked {
+	uint32_t item;
+	int score;
+};
+
+// The best fuzzy matches, as a heap with the worst of them on top.
+struct ranking {
+	struct ranked *best;
+	size_t len;
+};
+
+static void init_ranking(struct ranking *ranking) {
+	ranking->best = malloc(FUZZY_MATCH_ITEMS * sizeof *ranking->best);
+	ranking->len = 0;
+	if (!ranking->best) {
+		fprintf(stderr, "could not malloc %zu bytes",
+				FUZZY_MATCH_ITEMS * sizeof *ranking->best);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Returns whether a ranks below b. Ties go to the item which comes first.
+static bool ranks_below(struct ranked *a, struct ranked *b) {
+	return a->score < b->score
+		|| (a->score == b->score && a->item > b->item);
+}
+
+static int compare_ranked(const void *a, const void *b) {
+	struct ranked *ra = (struct ranked *)a, *rb = (struct ranked *)b;
+	return ranks_below(ra, rb) - ranks_below(rb, ra);
+}
+
+// Adds the match to the ranking if it is among the best.
+static void rank_item(struct ranking *ranking, uint32_t item, int score) {
+	struct ranked ranked = { item, score };
+	size_t i;
+	if (ranking->len < FUZZY_MATCH_ITEMS) {
+		/* sift up from the bottom */
+		for (i = ranking->len++; i > 0; i = (i - 1) / 2) {
+			struct ranked *parent = &ranking->best[(i - 1) / 2];
+			if (!ranks_below(&ranked, parent)) {
 				break;
 			}
+			ranking->best[i] = *parent;
 		}
-		if (i != tokc) {
-			/* not all tokens match */
+		ranking->best[i] = ranked;
+		return;
+	}
+	if (!ranks_below(&ranking->best[0], &ranked)) {
+		return;
+	}
+	/* replace the worst match and sift down */
+	for (i = 0; 2 * i + 1 < ranking->len;) {
+		size_t child = 2 * i + 1;
+		if (child + 1 < ranking->len
+				&& ranks_below(&ranking->best[child + 1], &ranking->best[child])) {
+			child++;
+		}
+		if (!ranks_below(&ranking->best[child], &ranked)) {
+			break;
+		}
+		ranking->best[i] = ranking->best[child];
+		i = child;
+	}
+	ranking->best[i] = ranked;
+}
+
+// A range of items to be matched by a worker thread.
+struct match_job {
+	struct menu *menu;
+	struct query *query;
+	struct token_set **sets; // set for each token of the query
+	uint64_t *items;         // items to match
+	size_t start, end;       // range of words of the bitsets
+	uint32_t *matched;       // matching items
+	unsigned char *kinds;    // how well each of them matches
+	size_t matched_len;
+	struct ranking *ranking; // best fuzzy matches, or NULL
+};
+
+// Matches a range of words of the bitsets. Ranges are matched in parallel on
+// the thread pool.
+static void match_chunk(void *data) {
+	struct match_job *job = data;
+	struct items *all = &job->menu->items;
+
+	for (size_t w = job->start; w < job->end; w++) {
+		uint64_t items = job->items[w];
+
+		if (job->ranking) {
+			struct token *pattern = &job->query->input;
+			for (; items; items &= items - 1) {
+				uint32_t item = w * 64 + __builtin_ctzll(items);
+				int score;
+				if (fuzzy_match(all->text[item], all->text_len[item],
+						pattern->text, pattern->len, pattern->fold, &score)) {
+					job->matched[job->matched_len++] = item;
+					rank_item(job->ranking, item, score);
+				}
+			}
 			continue;
 		}
-		if (!tokc || !menu->strncmp(menu->input, item->text, text_len + 1)) {
-			append_item(item, &lexact, &exactend);
-		} else if (!menu->strncmp(tokv[0], item->text, tok_len)) {
-			append_item(item, &lprefix, &prefixend);
-		} else {
-			append_item(item, &lsubstr, &substrend);
+
+		/* check the items not yet known to match each token */
+		for (int i = 0; i < job->query->tokc && items; i++) {
+			struct token_set *set = job->sets[i];
+			uint64_t unknown = items & ~set->known[w];
+			set->known[w] |= unknown;
+			for (; unknown; unknown &= unknown - 1) {
+				int bit = __builtin_ctzll(unknown);
+				if (fstrstr(all, w * 64 + bit, &job->query->tokv[i])) {
+					set->matches[w] |= (uint64_t)1 << bit;
+				}
+			}
+			items &= set->matches[w];
+		}
+
+		for (; items; items &= items - 1) {
+			uint32_t item = w * 64 + __builtin_ctzll(items);
+			job->kinds[job->matched_len] = classify_item(job->query, all, item);
+			job->matched[job->matched_len++] = item;
 		}
 	}
+}
 
-	if (lexact) {
-		menu->matches = lexact;
-		menu->matches_end = exactend;
+static void free_snapshot(struct snapshot *snapshot) {
+	free(snapshot->input);
+	free(snapshot->items);
+}
+
+// Pushes a snapshot onto the stack, dropping the oldest snapshots above the
+// initial one while the stack is full or their items take more than
+// SNAPSHOT_BYTES along with the new ones.
+static struct snapshot *push_snapshot(struct menu *menu, const char *input,
+		uint32_t *items, size_t len) {
+	size_t size = len * sizeof *items;
+	for (size_t i = 1; i < menu->nsnapshots; i++) {
+		size += menu->snapshots[i].len * sizeof *items;
 	}
-	if (lprefix) {
-		if (menu->matches_end) {
-			menu->matches_end->next_match = lprefix;
-			lprefix->prev_match = menu->matches_end;
-		} else {
-			menu->matches = lprefix;
+	while (menu->nsnapshots > 1 && (menu->nsnapshots == MAX_SNAPSHOTS
+			|| size > SNAPSHOT_BYTES)) {
+		size -= menu->snapshots[1].len * sizeof *items;
+		free_snapshot(&menu->snapshots[1]);
+		memmove(&menu->snapshots[1], &menu->snapshots[2],
+			(menu->nsnapshots - 2) * sizeof *menu->snapshots);
+		menu->nsnapshots--;
+	}
+	struct snapshot *snapshot = &menu->snapshots[menu->nsnapshots++];
+	snapshot->input = strdup(input);
+	snapshot->items = items;
+	snapshot->len = len;
+	snapshot->sel = NO_ITEM;
+	if (!snapshot->input) {
+		fprintf(stderr, "could not strdup %zu bytes", strlen(input) + 1);
+		exit(EXIT_FAILURE);
+	}
+	return snapshot;
+}
+
+// A match of an input in progress, which is abandoned once a newer input
+// arrives.
+struct pending_match {
+	unsigned long generation; // generation of the input
+	char input[BUFSIZ];
+	struct query query;
+	struct token_set **sets;  // set for each token of the query
+	struct token_set *temp;   // temporary sets of tokens not in the cache
+	uint64_t *items;          // items to match
+	size_t nwords;            // number of words of the bitsets
+	size_t next;              // next word to match
+	uint32_t *matched;        // matching items
+	unsigned char *kinds;     // how well each of them matches
+	size_t len;
+	struct ranking *ranking;  // best fuzzy matches, or NULL
+	bool full;                // whether the first page was published full
+};
+
+static void free_pending_match(struct pending_match *pending) {
+	for (int i = 0; pending->temp && i < pending->query.tokc; i++) {
+		free_token_set(&pending->temp[i]);
+	}
+	free(pending->temp);
+	free(pending->sets);
+	free(pending->items);
+	free(pending->matched);
+	free(pending->kinds);
+	if (pending->ranking) {
+		free(pending->ranking->best);
+		free(pending->ranking);
+	}
+	free(pending->query.tokv);
+	free(pending);
+}
+
+// Publishes matches of the input of the given generation to the event thread,
+// unless a newer input has arrived, and returns whether they were published.
+// Republishing the matches of an input keeps the item the user selected if it
+// still matches, and otherwise selects the first match again.
+static bool publish_matches(struct menu *menu, unsigned long generation,
+		uint32_t *items, unsigned char *kinds, size_t len,
+		uint32_t sel, bool complete, bool *full) {
+	pthread_mutex_lock(&menu->lock);
+	if (atomic_load(&menu->generation) != generation) {
+		pthread_mutex_unlock(&menu->lock);
+		return false;
+	}
+
+	if (menu->published != generation) {
+		menu->sel_moved = false;
+	} else if (menu->sel_moved) {
+		sel = menu->sel;
+	}
+	link_matches(menu, items, kinds, len);
+	/* the best fuzzy matches can leave out the selection */
+	for (uint32_t item = menu->matches; sel != NO_ITEM && item != NO_ITEM;
+			item = menu->items.next_match[item]) {
+		if (item == sel) {
+			menu->sel = sel;
+			page_items(menu, sel);
+			break;
 		}
-		menu->matches_end = prefixend;
 	}
-	if (lsubstr) {
-		if (menu->matches_end) {
-			menu->matches_end->next_match = lsubstr;
-			lsubstr->prev_match = menu->matches_end;
-		} else {
-			menu->matches = lsubstr;
+	if (full) {
+		*full = menu->npages > 0
+			&& menu->items.next_match[menu->pages[0].last] != NO_ITEM;
+	}
+	menu->published = generation;
+	if (complete) {
+		menu->matched = generation;
+	}
+	pthread_cond_broadcast(&menu->cond);
+	pthread_mutex_unlock(&menu->lock);
+
+	uint64_t one = 1;
+	if (write(menu->event, &one, sizeof one) < 0) {
+		/* the counter is already pending */
+	}
+	return true;
+}
+
+// Publishes the matching items, or the best of them in fuzzy mode.
+static bool publish_pending(struct menu *menu, struct pending_match *pending,
+		uint32_t *items, size_t len, uint32_t sel, bool complete) {
+	if (!pending->ranking) {
+		return publish_matches(menu, pending->generation, items,
+				pending->kinds, len, sel, complete, &pending->full);
+	}
+
+	struct ranking *ranking = pending->ranking;
+	struct ranked *best = malloc(MAX(ranking->len, 1) * sizeof *best);
+	uint32_t *ranked = malloc(MAX(ranking->len, 1) * sizeof *ranked);
+	unsigned char *kinds = calloc(MAX(ranking->len, 1), sizeof *kinds);
+	if (!best || !ranked || !kinds) {
+		fprintf(stderr, "could not malloc %zu bytes", ranking->len
+				* (sizeof *best + sizeof *ranked + sizeof *kinds));
+		exit(EXIT_FAILURE);
+	}
+	memcpy(best, ranking->best, ranking->len * sizeof *best);
+	qsort(best, ranking->len, sizeof *best, compare_ranked);
+	for (size_t i = 0; i < ranking->len; i++) {
+		ranked[i] = best[i].item;
+	}
+
+	bool published = publish_matches(menu, pending->generation, ranked,
+			kinds, ranking->len, sel, complete, &pending->full);
+	free(kinds);
+	free(ranked);
+	free(best);
+	return published;
+}
+
+// Matches the next slice of items. Returns false if a newer input arrived.
+static bool match_slice(struct menu *menu, struct pending_match *pending) {
+	if (atomic_load(&menu->generation) != pending->generation) {
+		return false;
+	}
+	size_t end = MIN(pending->next + MATCH_SLICE_ITEMS / 64, pending->nwords);
+
+	/* split the slice into chunks for each thread if there are enough
+	 * items, and check the tokens whose sets are not yet known */
+	size_t njobs = menu->snapshots[menu->nsnapshots - 1].len >= PARALLEL_MATCH_ITEMS
+		? menu->threads : 1;
+	struct match_job *jobs = calloc(njobs, sizeof *jobs);
+	if (!jobs) {
+		fprintf(stderr, "could not calloc %zu bytes", njobs * sizeof *jobs);
+		exit(EXIT_FAILURE);
+	}
+	size_t chunk = (end - pending->next + njobs - 1) / njobs;
+	for (size_t i = 0; i < njobs; i++) {
+		jobs[i].menu = menu;
+		jobs[i].query = &pending->query;
+		jobs[i].sets = pending->sets;
+		jobs[i].items = pending->items;
+		jobs[i].start = MIN(pending->next + i * chunk, end);
+		jobs[i].end = MIN(jobs[i].start + chunk, end);
+		jobs[i].matched = pending->matched + jobs[i].start * 64;
+		jobs[i].kinds = pending->kinds + jobs[i].start * 64;
+		if (pending->ranking) {
+			jobs[i].ranking = calloc(1, sizeof *jobs[i].ranking);
+			if (!jobs[i].ranking) {
+				fprintf(stderr, "could not calloc %zu bytes",
+						sizeof *jobs[i].ranking);
+				exit(EXIT_FAILURE);
+			}
+			init_ranking(jobs[i].ranking);
 		}
-		menu->matches_end = substrend;
 	}
+	thread_pool_run(menu->thread_pool, match_chunk, jobs, sizeof *jobs, njobs);
 
-	page_items(menu);
-	if (menu->pages) {
-		menu->sel = menu->pages->first;
+	/* join the chunks in input order */
+	for (size_t i = 0; i < njobs; i++) {
+		memmove(pending->matched + pending->len, jobs[i].matched,
+				jobs[i].matched_len * sizeof *pending->matched);
+		memmove(pending->kinds + pending->len, jobs[i].kinds,
+				jobs[i].matched_len * sizeof *pending->kinds);
+		pending->len += jobs[i].matched_len;
+
+		if (jobs[i].ranking) {
+			for (size_t j = 0; j < jobs[i].ranking->len; j++) {
+				struct ranked *ranked = &jobs[i].ranking->best[j];
+				rank_item(pending->ranking, ranked->item, ranked->score);
+			}
+			free(jobs[i].ranking->best);
+			free(jobs[i].ranking);
+		}
 	}
+	pending->next = end;
+	free(jobs);
+	return true;
 }
 
-// Read menu items from standard input.
-void read_menu_items(struct menu *menu) {
-	char buf[sizeof menu->input];
+// Matches the items against the input of the given generation. The matches are
+// published as soon as they fill the first page, and again once every item is
+// matched, though matches found later can move ahead of those on the first
+// page. Returns whether the published matches are those of the last snapshot.
+static bool match_input(struct menu *menu, const char *input,
+		unsigned long generation) {
+	struct pending_match *pending = calloc(1, sizeof *pending);
+	if (!pending) {
+		fprintf(stderr, "could not calloc %zu bytes", sizeof *pending);
+		exit(EXIT_FAILURE);
+	}
+	pending->generation = generation;
+	strcpy(pending->input, input);
+	struct query *query = &pending->query;
+	parse_query(menu, pending->input, query);
+	if (menu->fuzzy && query->input.len > 0) {
+		pending->ranking = calloc(1, sizeof *pending->ranking);
+		if (!pending->ranking) {
+			fprintf(stderr, "could not calloc %zu bytes", sizeof *pending->ranking);
+			exit(EXIT_FAILURE);
+		}
+		init_ranking(pending->ranking);
+	}
 
-	struct item **next = &menu->items;
-	while (fgets(buf, sizeof buf, stdin)) {
-		char *p = strchr(buf, '\n');
-		if (p) {
-			*p = '\0';
+	/* go back to the last input which the new input narrows down */
+	struct snapshot *top = &menu->snapshots[menu->nsnapshots - 1];
+	while (menu->nsnapshots > 1 && !input_narrows(menu, top->input, input)) {
+		free_snapshot(top);
+		top = &menu->snapshots[--menu->nsnapshots - 1];
+	}
+	if (strcmp(top->input, input) == 0) {
+		pending->kinds = malloc(MAX(top->len, 1) * sizeof *pending->kinds);
+		if (!pending->kinds) {
+			fprintf(stderr, "could not malloc %zu bytes", top->len);
+			exit(EXIT_FAILURE);
 		}
-		struct item *item = calloc(1, sizeof *item);
-		if (!item) {
-			return;
+		for (size_t i = 0; i < top->len; i++) {
+			uint32_t item = top->items[i];
+			int score;
+			if (!pending->ranking) {
+				pending->kinds[i] = classify_item(query, &menu->items, item);
+			} else if (fuzzy_match(menu->items.text[item],
+					menu->items.text_len[item], query->input.text,
+					query->input.len, query->input.fold, &score)) {
+				rank_item(pending->ranking, item, score);
+			}
+		}
+		bool published = publish_pending(menu, pending, top->items, top->len,
+				top->sel, true);
+		free_pending_match(pending);
+		return published;
+	}
+
+	size_t nitems = menu->snapshots[0].len;
+	pending->nwords = (nitems + 63) / 64;
+
+	/* only the items matching the previous input can match */
+	pending->items = alloc_bitset(pending->nwords);
+	if (top == &menu->snapshots[0]) {
+		fill_bitset(pending->items, nitems);
+	} else {
+		for (size_t i = 0; i < top->len; i++) {
+			uint32_t item = top->items[i];
+			pending->items[item / 64] |= (uint64_t)1 << (item % 64);
+		}
+	}
+
+	/* look up the items known to match each token */
+	pending->sets = calloc(MAX(query->tokc, 1), sizeof *pending->sets);
+	pending->temp = calloc(MAX(query->tokc, 1), sizeof *pending->temp);
+	if (!pending->sets || !pending->temp) {
+		fprintf(stderr, "could not calloc %zu bytes",
+				query->tokc * (sizeof *pending->sets + sizeof *pending->temp));
+		exit(EXIT_FAILURE);
+	}
+	unsigned long since = menu->token_clock;
+	for (int i = 0; !pending->ranking && i < query->tokc; i++) {
+		pending->sets[i] = get_token_set(menu, &query->tokv[i], since,
+				&pending->temp[i]);
+	}
+
+	pending->matched = malloc(MAX(nitems, 1) * sizeof *pending->matched);
+	pending->kinds = malloc(MAX(nitems, 1) * sizeof *pending->kinds);
+	if (!pending->matched || !pending->kinds) {
+		fprintf(stderr, "could not malloc %zu bytes",
+				nitems * (sizeof *pending->matched + sizeof *pending->kinds));
+		exit(EXIT_FAILURE);
+	}
+
+	do {
+		if (!match_slice(menu, pending)) {
+			free_pending_match(pending);
+			return false;
+		}
+		if (!pending->full && pending->next < pending->nwords) {
+			publish_pending(menu, pending, pending->matched, pending->len,
+					NO_ITEM, false);
+		}
+	} while (pending->next < pending->nwords);
+
+	bool published = publish_pending(menu, pending, pending->matched,
+			pending->len, NO_ITEM, true);
+
+	uint32_t *matched = realloc(pending->matched,
+			MAX(pending->len, 1) * sizeof *matched);
+	if (matched) {
+		pending->matched = matched;
+	}
+	push_snapshot(menu, input, pending->matched, pending->len);
+	pending->matched = NULL;
+	free_pending_match(pending);
+	return published;
+}
+
+static void *grow_array(void *array, size_t len, size_t size) {
+	void *grown = realloc(array, MAX(len, 1) * size);
+	if (!grown) {
+		fprintf(stderr, "could not realloc %zu bytes", len * size);
+		exit(EXIT_FAILURE);
+	}
+	return grown;
+}
+
+// Makes room in the arrays for the given number of items.
+static void reserve_items(struct items *items, size_t len) {
+	if (len <= items->size) {
+		return;
+	}
+	size_t size = MAX(len, 2 * items->size);
+	items->text = grow_array(items->text, size, sizeof *items->text);
+	items->folded = grow_array(items->folded, size, sizeof *items->folded);
+	items->text_len = grow_array(items->text_len, size, sizeof *items->text_len);
+	items->width = grow_array(items->width, size, sizeof *items->width);
+	items->prev_match = grow_array(items->prev_match, size,
+			sizeof *items->prev_match);
+	items->next_match = grow_array(items->next_match, size,
+			sizeof *items->next_match);
+	items->page = grow_array(items->page, size, sizeof *items->page);
+	items->size = size;
+}
+
+static void free_items(struct items *items) {
+	free(items->text);
+	free(items->folded);
+	free(items->text_len);
+	free(items->width);
+	free(items->prev_match);
+	free(items->next_match);
+	free(items->page);
+	memset(items, 0, sizeof *items);
+}
+
+// Takes the items which were read since the last call into the arrays of all
+// items. The event thread only reads the arrays with the lock held, so they
+// can be grown here. Called with the lock held.
+static void take_items(struct menu *menu) {
+	struct items *items = &menu->items, *new_items = &menu->new_items;
+	if (new_items->len > 0 && items->len == 0) {
+		/* take the arrays of the first items as they are */
+		struct items empty = *items;
+		*items = *new_items;
+		*new_items = empty;
+	} else if (new_items->len > 0) {
+		size_t len = new_items->len;
+		reserve_items(items, items->len + len);
+		memcpy(items->text + items->len, new_items->text, len * sizeof *items->text);
+		memcpy(items->folded + items->len, new_items->folded,
+				len * sizeof *items->folded);
+		memcpy(items->text_len + items->len, new_items->text_len,
+				len * sizeof *items->text_len);
+		memcpy(items->width + items->len, new_items->width,
+				len * sizeof *items->width);
+		items->len += len;
+		new_items->len = 0;
+	}
+	if (menu->eof) {
+		free_items(new_items);
+	}
+
+	struct snapshot *all = &menu->snapshots[0];
+	all->items = grow_array(all->items, items->len, sizeof *all->items);
+	for (; all->len < items->len; all->len++) {
+		all->items[all->len] = all->len;
+	}
+}
+
+// Adds the items from the given position in the arrays of all items to the
+// snapshots and to the sets of known tokens.
+static void add_items(struct menu *menu, size_t start) {
+	size_t nitems = menu->snapshots[0].len;
+	size_t old_words = (start + 63) / 64, nwords = (nitems + 63) / 64;
+	for (size_t i = 0; i < TOKEN_CACHE_SIZE; i++) {
+		struct token_set *set = &menu->token_sets[i];
+		if (!set->text || old_words == nwords) {
+			continue;
+		}
+		set->known = realloc(set->known, nwords * sizeof *set->known);
+		set->matches = realloc(set->matches, nwords * sizeof *set->matches);
+		if (!set->known || !set->matches) {
+			fprintf(stderr, "could not realloc %zu bytes",
+					2 * nwords * sizeof *set->known);
+			exit(EXIT_FAILURE);
+		}
+		memset(set->known + old_words, 0, (nwords - old_words) * sizeof *set->known);
+		memset(set->matches + old_words, 0, (nwords - old_words) * sizeof *set->matches);
+	}
+
+	/* only the new items of the previous snapshot can be new in a snapshot */
+	for (size_t i = 1; i < menu->nsnapshots; i++) {
+		struct snapshot *prev = &menu->snapshots[i - 1];
+		struct snapshot *snapshot = &menu->snapshots[i];
+		size_t len = snapshot->len;
+
+		struct query query;
+		parse_query(menu, snapshot->input, &query);
+		snapshot->items = grow_array(snapshot->items,
+				snapshot->len + prev->len - start, sizeof *snapshot->items);
+		for (size_t j = start; j < prev->len; j++) {
+			if (item_matches(menu, &query, prev->items[j])) {
+				snapshot->items[snapshot->len++] = prev->items[j];
+			}
+		}
+		free(query.tokv);
+		start = len;
+	}
+}
+
+// Matches each new input on a background thread, so that the event thread
+// is not held up by matching. New items are matched against the inputs of
+// the snapshots as they are read.
+static void *match_thread(void *data) {
+	struct menu *menu = data;
+	unsigned long generation = 0;
+	bool settled = false, eof = false;
+
+	while (true) {
+		char input[BUFSIZ];
+
+		pthread_mutex_lock(&menu->lock);
+		while (atomic_load(&menu->generation) == generation
+				&& menu->snapshots[0].len == menu->nitems
+				&& menu->eof == eof) {
+			pthread_cond_wait(&menu->cond, &menu->lock);
+		}
+		size_t start = menu->snapshots[0].len;
+		take_items(menu);
+		eof = menu->eof;
+		if (menu->snapshots[0].len > start) {
+			/* the published matches leave out the new items */
+			menu->matched = 0;
 		}
-		item->text = strdup(buf);
+		bool changed = atomic_load(&menu->generation) != generation;
+		generation = atomic_load(&menu->generation);
+		strcpy(input, menu->query);
+		/* remember the selection of the last input */
+		if (settled && changed) {
+			menu->snapshots[menu->nsnapshots - 1].sel = menu->sel;
+		}
+		pthread_mutex_unlock(&menu->lock);
 
-		*next = item;
-		next = &item->next;
+		size_t nitems = menu->snapshots[0].len;
+		if (nitems > start) {
+			add_items(menu, start);
+		}
+		if (eof && !menu->index && nitems >= TRIGRAM_INDEX_ITEMS) {
+			menu->index = trigram_index_create(menu->items.text,
+					menu->items.text_len, nitems);
+		}
+		/* the matches of the last input are republished with the new items */
+		if (changed || (settled && nitems > start)) {
+			settled = match_input(menu, input, generation);
+		}
 	}
+	return NULL;
+}
+
+// Starts the matching thread, with every item matching the empty input.
+static void start_matching(struct menu *menu) {
+	push_snapshot(menu, "", NULL, 0);
+	atomic_store(&menu->generation, 1);
 
-	calc_widths(menu);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, match_thread, menu) != 0) {
+		fprintf(stderr, "could not create matching thread\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+}
+
+// Marks the input as changed. It is matched once the batch of events being
+// dispatched is handled, so that a burst of edits is matched only once.
+static void schedule_match(struct menu *menu) {
+	menu->rematch = true;
+}
+
+// Selects an item on behalf of the user, so that republished matches keep it.
+static void select_item(struct menu *menu, uint32_t item) {
+	menu->sel = item;
+	menu->sel_moved = true;
+}
+
+// Hands the input to the matching thread if it changed. Called with the lock
+// held.
+void match_items(struct menu *menu) {
+	if (!menu->rematch) {
+		return;
+	}
+	menu->rematch = false;
+	strcpy(menu->query, menu->input);
+	atomic_fetch_add(&menu->generation, 1);
+	pthread_cond_broadcast(&menu->cond);
+}
+
+// Waits for every item to be matched against the current input, including
+// those read but not yet taken by the matching thread. Called with the lock
+// held.
+static void wait_for_matches(struct menu *menu) {
 	match_items(menu);
+	unsigned long generation = atomic_load(&menu->generation);
+	while (menu->matched != generation
+			|| menu->snapshots[0].len != menu->nitems) {
+		pthread_cond_wait(&menu->cond, &menu->lock);
+	}
+}
+
+// Makes a lowercase copy of the item text, so that case-insensitive matching
+// can compare bytes directly. Items without uppercase letters share their text.
+static char *fold_text(struct menu *menu, char *text, size_t len) {
+	if (!has_upper(text, len)) {
+		return text;
+	}
+	char *folded = arena_alloc(&menu->text_arena, len + 1, 1);
+	if (!folded) {
+		// Fold while matching instead
+		return NULL;
+	}
+	for (size_t i = 0; i < len; i++) {
+		folded[i] = fold(text[i]);
+	}
+	folded[len] = '\0';
+	return folded;
+}
+
+// Adds an item with the given text, which must live until exit and need not
+// be NUL-terminated, to the items to be taken by the matching thread. The text
+// ends at the first NUL of the line, whether it was copied or mapped.
+static void add_item(struct menu *menu, char *text, size_t len) {
+	if (!text || menu->nitems >= NO_ITEM) {
+		return;
+	}
+	len = strnlen(text, len);
+	struct items *items = &menu->new_items;
+	reserve_items(items, items->len + 1);
+	items->text[items->len] = text;
+	items->folded[items->len] = menu->insensitive
+		? fold_text(menu, text, len) : NULL;
+	items->text_len[items->len] = MIN(len, UINT32_MAX);
+	items->width[items->len] = -1;
+	items->len++;
+	menu->nitems++;
+}
+
+// Maps standard input if it is a regular file, and adds an item for each of
+// its lines. The items point into the read-only mapping, so they are not
+// NUL-terminated and the file is never copied. Returns whether the file was
+// mapped.
+static bool map_menu_items(struct menu *menu) {
+	struct stat st;
+	off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+	if (offset < 0 || fstat(STDIN_FILENO, &st) == -1 || !S_ISREG(st.st_mode)
+			|| st.st_size <= offset) {
+		return false;
+	}
+
+	/* the mapping starts at a page boundary */
+	long page = sysconf(_SC_PAGESIZE);
+	off_t base = offset - offset % page;
+	size_t size = st.st_size - base;
+	char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, base);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	size_t start = menu->new_items.len;
+	for (char *p = data + (offset - base), *end = data + size; p < end;) {
+		char *newline = memchr(p, '\n', end - p);
+		size_t len = (newline ? newline : end) - p;
+		add_item(menu, p, len);
+		p += len + 1;
+	}
+
+	if (menu->new_items.len > start) {
+		calc_item_widths(menu, start);
+	}
+	menu->eof = true;
+	pthread_cond_broadcast(&menu->cond);
+	return true;
+}
+
+// Reads the items available on standard input, and hands them to the
+// matching thread. Returns false once standard input is closed. If standard
+// input is a regular file, it is mapped and read at once instead.
+bool read_menu_items(struct menu *menu) {
+	if (menu->nitems == 0 && menu->line_len == 0 && map_menu_items(menu)) {
+		return false;
+	}
+
+	char buf[READ_SIZE];
+	ssize_t n = read(STDIN_FILENO, buf, sizeof buf);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return true;
+	}
+
+	size_t start = menu->new_items.len;
+	for (char *p = buf, *end = buf + MAX(n, 0); p < end;) {
+		char *newline = memchr(p, '\n', end - p);
+		if (newline && menu->line_len == 0) {
+			/* the whole line was read, so copy it from the read buffer */
+			add_item(menu, arena_strndup(&menu->text_arena, p, newline - p),
+					newline - p);
+			p = newline + 1;
+			continue;
+		}
+
+		/* keep the start of the line until the rest of it is read */
+		size_t len = (newline ? newline : end) - p;
+		if (menu->line_len + len > menu->line_size) {
+			size_t size = MAX(menu->line_len + len, 2 * menu->line_size);
+			char *line = realloc(menu->line, size);
+			if (!line) {
+				fprintf(stderr, "could not realloc %zu bytes", size);
+				exit(EXIT_FAILURE);
+			}
+			menu->line = line;
+			menu->line_size = size;
+		}
+		memcpy(menu->line + menu->line_len, p, len);
+		menu->line_len += len;
+		p += len;
+
+		if (p == newline) {
+			add_item(menu, arena_strndup(&menu->text_arena, menu->line,
+					menu->line_len), menu->line_len);
+			menu->line_len = 0;
+			p++;
+		}
+	}
+	if (n <= 0) {
+		if (menu->line_len > 0) {
+			add_item(menu, arena_strndup(&menu->text_arena, menu->line,
+					menu->line_len), menu->line_len);
+			menu->line_len = 0;
+		}
+		free(menu->line);
+		menu->line = NULL;
+		menu->line_size = 0;
+		menu->eof = true;
+	}
+
+	if (menu->new_items.len > start) {
+		calc_item_widths(menu, start);
+	}
+	pthread_cond_broadcast(&menu->cond);
+	return n > 0;
 }
 
 static void insert(struct menu *menu, const char *s, ssize_t n) {
@@ -393,6 +1416,7 @@ void menu_keypress(struct menu *menu, enum wl_keyboard_key_state key_state,
 			XKB_STATE_MODS_DEPRESSED | XKB_STATE_MODS_LATCHED);
 
 	size_t len = strlen(menu->input);
+	struct items *items = &menu->items;
 
 	if (ctrl) {
 		// Emacs-style line editing bindings
@@ -444,14 +1468,14 @@ void menu_keypress(struct menu *menu, enum wl_keyboard_key_state key_state,
 		case XKB_KEY_k:
 			// Delete right
 			menu->input[menu->cursor] = '\0';
-			match_items(menu);
-			render_menu(menu);
+			schedule_match(menu);
+			schedule_frame(menu);
 			return;
 		case XKB_KEY_u:
 			// Delete left
 			insert(menu, NULL, 0 - menu->cursor);
-			match_items(menu);
-			render_menu(menu);
+			schedule_match(menu);
+			schedule_frame(menu);
 			return;
 		case XKB_KEY_w:
 			// Delete word
@@ -461,8 +1485,8 @@ void menu_keypress(struct menu *menu, enum wl_keyboard_key_state key_state,
 			while (menu->cursor > 0 && menu->input[nextrune(menu, -1)] != ' ') {
 				insert(menu, NULL, nextrune(menu, -1) - menu->cursor);
 			}
-			match_items(menu);
-			render_menu(menu);
+			schedule_match(menu);
+			schedule_frame(menu);
 			return;
 		case XKB_KEY_Y:
 			// Paste clipboard
@@ -492,18 +1516,18 @@ void menu_keypress(struct menu *menu, enum wl_keyboard_key_state key_state,
 
 			wl_data_offer_destroy(menu->offer);
 			menu->offer = NULL;
-			match_items(menu);
-			render_menu(menu);
+			schedule_match(menu);
+			schedule_frame(menu);
 			return;
 		case XKB_KEY_Left:
 		case XKB_KEY_KP_Left:
 			movewordedge(menu, -1);
-			render_menu(menu);
+			schedule_frame(menu);
 			return;
 		case XKB_KEY_Right:
 		case XKB_KEY_KP_Right:
 			movewordedge(menu, +1);
-			render_menu(menu);
+			schedule_frame(menu);
 			return;
 
 		case XKB_KEY_Return:
@@ -517,11 +1541,11 @@ void menu_keypress(struct menu *menu, enum wl_keyboard_key_state key_state,
 		switch (sym) {
 		case XKB_KEY_b:
 			movewordedge(menu, -1);
-			render_menu(menu);
+			schedule_frame(menu);
 			return;
 		case XKB_KEY_f:
 			movewordedge(menu, +1);
-			render_menu(menu);
+			schedule_frame(menu);
 			return;
 		case XKB_KEY_g:
 			sym = XKB_KEY_Home;
@@ -550,13 +1574,18 @@ void menu_keypress(struct menu *menu, enum wl_keyboard_key_state key_state,
 	switch (sym) {
 	case XKB_KEY_Return:
 	case XKB_KEY_KP_Enter:
+		wait_for_matches(menu);
 		if (shift) {
 			puts(menu->input);
 			fflush(stdout);
 			menu->exit = true;
 		} else {
-			char *text = menu->sel ? menu->sel->text : menu->input;
-			puts(text);
+			if (menu->sel != NO_ITEM) {
+				fwrite(items->text[menu->sel], 1, items->text_len[menu->sel], stdout);
+				putchar('\n');
+			} else {
+				puts(menu->input);
+			}
 			fflush(stdout);
 			if (!ctrl) {
 				menu->exit = true;
@@ -567,12 +1596,12 @@ void menu_keypress(struct menu *menu, enum wl_keyboard_key_state key_state,
 	case XKB_KEY_KP_Left:
 	case XKB_KEY_Up:
 	case XKB_KEY_KP_Up:
-		if (menu->sel && menu->sel->prev_match) {
-			menu->sel = menu->sel->prev_match;
-			render_menu(menu);
+		if (menu->sel != NO_ITEM && items->prev_match[menu->sel] != NO_ITEM) {
+			select_item(menu, items->prev_match[menu->sel]);
+			schedule_frame(menu);
 		} else if (menu->cursor > 0) {
 			menu->cursor = nextrune(menu, -1);
-			render_menu(menu);
+			schedule_frame(menu);
 		}
 		break;
 	case XKB_KEY_Right:
@@ -581,51 +1610,64 @@ void menu_keypress(struct menu *menu, enum wl_keyboard_key_state key_state,
 	case XKB_KEY_KP_Down:
 		if (menu->cursor < len) {
 			menu->cursor = nextrune(menu, +1);
-			render_menu(menu);
-		} else if (menu->sel && menu->sel->next_match) {
-			menu->sel = menu->sel->next_match;
-			render_menu(menu);
+			schedule_frame(menu);
+		} else if (menu->sel != NO_ITEM
+				&& items->next_match[menu->sel] != NO_ITEM) {
+			select_item(menu, items->next_match[menu->sel]);
+			page_items(menu, menu->sel);
+			schedule_frame(menu);
 		}
 		break;
 	case XKB_KEY_Prior:
 	case XKB_KEY_KP_Prior:
-		if (menu->sel && menu->sel->page->prev) {
-			menu->sel = menu->sel->page->prev->first;
-			render_menu(menu);
+		if (menu->sel != NO_ITEM && items->page[menu->sel] > 0) {
+			select_item(menu, menu->pages[items->page[menu->sel] - 1].first);
+			schedule_frame(menu);
 		}
 		break;
 	case XKB_KEY_Next:
 	case XKB_KEY_KP_Next:
-		if (menu->sel && menu->sel->page->next) {
-			menu->sel = menu->sel->page->next->first;
-			render_menu(menu);
+		wait_for_matches(menu);
+		if (menu->sel == NO_ITEM) {
+			break;
+		}
+		/* the next page starts after the last item of this page */
+		uint32_t next = items->next_match[menu->pages[items->page[menu->sel]].last];
+		if (next != NO_ITEM) {
+			select_item(menu, next);
+			page_items(menu, menu->sel);
+			schedule_frame(menu);
 		}
 		break;
 	case XKB_KEY_Home:
 	case XKB_KEY_KP_Home:
 		if (menu->sel == menu->matches) {
 			menu->cursor = 0;
-			render_menu(menu);
+			schedule_frame(menu);
 		} else {
-			menu->sel = menu->matches;
-			render_menu(menu);
+			select_item(menu, menu->matches);
+			schedule_frame(menu);
 		}
 		break;
 	case XKB_KEY_End:
 	case XKB_KEY_KP_End:
 		if (menu->cursor < len) {
 			menu->cursor = len;
-			render_menu(menu);
+			schedule_frame(menu);
 		} else {
-			menu->sel = menu->matches_end;
-			render_menu(menu);
+			wait_for_matches(menu);
+			select_item(menu, menu->matches_end);
+			if (menu->sel != NO_ITEM) {
+				page_items(menu, menu->sel);
+			}
+			schedule_frame(menu);
 		}
 		break;
 	case XKB_KEY_BackSpace:
 		if (menu->cursor > 0) {
 			insert(menu, NULL, nextrune(menu, -1) - menu->cursor);
-			match_items(menu);
-			render_menu(menu);
+			schedule_match(menu);
+			schedule_frame(menu);
 		}
 		break;
 	case XKB_KEY_Delete:
@@ -635,18 +1677,19 @@ void menu_keypress(struct menu *menu, enum wl_keyboard_key_state key_state,
 		}
 		menu->cursor = nextrune(menu, +1);
 		insert(menu, NULL, nextrune(menu, -1) - menu->cursor);
-		match_items(menu);
-		render_menu(menu);
+		schedule_match(menu);
+		schedule_frame(menu);
 		break;
 	case XKB_KEY_Tab:
-		if (!menu->sel) {
+		wait_for_matches(menu);
+		if (menu->sel == NO_ITEM) {
 			return;
 		}
-		menu->cursor = strnlen(menu->sel->text, sizeof menu->input - 1);
-		memcpy(menu->input, menu->sel->text, menu->cursor);
+		menu->cursor = MIN(items->text_len[menu->sel], sizeof menu->input - 1);
+		memcpy(menu->input, items->text[menu->sel], menu->cursor);
 		menu->input[menu->cursor] = '\0';
-		match_items(menu);
-		render_menu(menu);
+		schedule_match(menu);
+		schedule_frame(menu);
 		break;
 	case XKB_KEY_Escape:
 		menu->exit = true;
@@ -655,8 +1698,8 @@ void menu_keypress(struct menu *menu, enum wl_keyboard_key_state key_state,
 	default:
 		if (xkb_keysym_to_utf8(sym, buf, 8)) {
 			insert(menu, buf, strnlen(buf, 8));
-			match_items(menu);
-			render_menu(menu);
+			schedule_match(menu);
+			schedule_frame(menu);
 		}
 	}
 }
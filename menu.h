@@ -1,26 +1,80 @@
 #ifndef WMENU_MENU_H
 #define WMENU_MENU_H
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <xkbcommon/xkbcommon.h>
 
+#include "arena.h"
 #include "pool-buffer.h"
-
-// A menu item.
-struct item {
-	char *text;
-	int width;
-	struct item *next;       // traverses all items
-	struct item *prev_match; // previous matching item
-	struct item *next_match; // next matching item
-	struct page *page;       // the page holding this item
+#include "thread-pool.h"
+
+// No item, in place of an item position.
+#define NO_ITEM UINT32_MAX
+
+// Menu items, stored as arrays indexed by item position.
+struct items {
+	char **text;          // text of each item
+	char **folded;        // lowercase text for case-insensitive matching
+	uint32_t *text_len;   // length of each text
+	int *width;           // width of each text, or -1 if not yet measured
+	uint32_t *prev_match; // previous matching item
+	uint32_t *next_match; // next matching item
+	uint32_t *page;       // the page holding each item
+	size_t len;           // number of items
+	size_t size;          // number of items the arrays have room for
 };
 
 // A page of menu items.
 struct page {
-	struct item *first; // first item in the page
-	struct item *last;  // last item in the page
-	struct page *prev;  // previous page
-	struct page *next;  // next page
+	uint32_t first; // first item in the page
+	uint32_t last;  // last item in the page
+};
+
+#define MAX_SNAPSHOTS 32
+
+// A snapshot of the items matching an input.
+struct snapshot {
+	char *input;     // the input the items were matched against
+	uint32_t *items; // matching items in input order
+	size_t len;      // number of matching items
+	uint32_t sel;    // selected item
+};
+
+#define TOKEN_CACHE_SIZE 16
+
+// The items matching a token, as bitsets indexed by item position.
+struct token_set {
+	char *text;         // the token, or NULL if unused
+	bool fold;          // whether the token is matched case-insensitively
+	uint64_t *known;    // items which were checked against the token
+	uint64_t *matches;  // items which match the token
+	unsigned long used; // when the set was last used
+};
+
+#define ITEM_CACHE_SIZE 128
+
+// An item rendered on its own, to be composited into the buffers.
+struct item_strip {
+	cairo_surface_t *surface; // NULL if unused
+	uint32_t item;
+	bool selected;
+	int32_t scale;
+	int width;                // width in surface coordinates
+	size_t size;              // size of the pixels in bytes
+	unsigned long used;       // when the strip was last used
+};
+
+// The state a frame was drawn with, to redraw only what changed since.
+struct frame {
+	struct wl_buffer *buffer; // buffer the frame was drawn into, or NULL
+	int32_t width, height, scale;
+	int promptw, inputw;
+	char input[BUFSIZ];
+	size_t cursor;
+	int input_right;          // right edge of the input text
+	uint32_t sel;
+	unsigned long relinks;
 };
 
 // A Wayland output.
@@ -63,6 +117,16 @@ struct menu {
 
 	struct pool_buffer buffers[2];
 	struct pool_buffer *current;
+	cairo_surface_t *pending; // frame recorded while both buffers were busy
+	struct frame frames[2];   // the frames the buffers show
+	struct frame *shown;      // the frame last committed, or NULL
+	struct wl_callback *frame_callback; // pending frame callback, or NULL
+	bool dirty;               // whether a frame is to be drawn
+	struct item_strip strips[ITEM_CACHE_SIZE]; // recently rendered items
+	size_t strips_size;       // size of their pixels in bytes
+	unsigned long strips_clock;
+	struct width_cache *width_cache;
+	int ascii_advances[128]; // advances of monospace ASCII, in Pango units
 
 	int width;
 	int height;
@@ -74,7 +138,8 @@ struct menu {
 	int right_arrow;
 
 	bool bottom;
-	int (*strncmp)(const char *, const char *, size_t);
+	bool insensitive;
+	bool fuzzy;
 	char *font;
 	int lines;
 	char *prompt;
@@ -85,18 +150,51 @@ struct menu {
 	char input[BUFSIZ];
 	size_t cursor;
 
-	struct item *items;       // list of all items
-	struct item *matches;     // list of matching items
-	struct item *matches_end; // last matching item
-	struct item *sel;         // selected item
-	struct page *pages;       // list of pages
+	char *line;               // line being read from standard input
+	size_t line_len;
+	size_t line_size;
+	bool eof;                 // whether standard input is closed
+
+	struct items items;       // all items, grown by the matching thread
+	struct items new_items;   // items read since the matching thread took them
+	size_t nitems;            // number of items
+	struct arena text_arena;  // storage of the item texts
+	uint32_t matches;         // first matching item
+	uint32_t matches_end;     // last matching item
+	uint32_t sel;             // selected item
+	bool sel_moved;           // whether the user moved the selection
+	struct page *pages;       // pages of matching items
+	size_t npages;            // number of pages
+	size_t pages_size;        // number of pages there is room for
+	uint32_t unpaged;         // first matching item not yet on a page
+	unsigned long relinks;    // number of times the matches were linked
+
+	struct snapshot snapshots[MAX_SNAPSHOTS];      // previous match results
+	size_t nsnapshots;                             // number of snapshots
+	size_t threads;                                // number of matching threads
+	struct thread_pool *thread_pool;               // workers matching and measuring items
+	struct trigram_index *index;                   // index of all items, or NULL
+	struct token_set token_sets[TOKEN_CACHE_SIZE]; // recently used tokens
+	unsigned long token_clock;                     // time of the last token lookup
+
+	// The event thread holds the lock except while polling. The matching
+	// thread takes it to read new inputs and to publish matches.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;             // signals new inputs and published matches
+	char query[BUFSIZ];              // input to be matched
+	bool rematch;                    // whether the input is yet to be matched
+	atomic_ulong generation;         // generation of the input to be matched
+	unsigned long published;         // generation of the published matches
+	unsigned long matched;           // generation of the last complete matches
+	int event;                       // eventfd signalled on published matches
 
 	bool exit;
 	bool failure;
 };
 
 void menu_init(struct menu *menu, int argc, char *argv[]);
-void read_menu_items(struct menu *menu);
+bool read_menu_items(struct menu *menu);
+void match_items(struct menu *menu);
 void menu_keypress(struct menu *menu, enum wl_keyboard_key_state key_state,
 		xkb_keysym_t sym);
 
@@ -1,67 +1,283 @@
+#define _POSIX_C_SOURCE 200809L
 #include <cairo/cairo.h>
 #include <pango/pangocairo.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "pango.h"
 
+// Number of shaped layouts kept by each thread
+#ifndef LAYOUT_CACHE_SIZE
+#define LAYOUT_CACHE_SIZE 128
+#endif
+
+// A shaped layout of a text.
+struct cached_layout {
+	PangoLayout *layout;
+	char *text;
+	int len;
+	uint64_t hash;
+	double scale;
+	uint64_t used; // when the layout was last used
+};
+
+// Recently used layouts, which share a Pango context. Text is shaped by both
+// the event thread and the matching thread, so each has a cache of its own.
+struct layout_cache {
+	char *font;
+	PangoFontDescription *desc;
+	PangoContext *context;
+	cairo_font_options_t *options; // font options the context was updated for
+	cairo_matrix_t matrix; // transformation the context was updated for
+	struct cached_layout layouts[LAYOUT_CACHE_SIZE];
+	uint64_t clock;
+};
+
+static _Thread_local struct layout_cache cache;
+
+// Returns the description of the font, parsed once. Layouts of another font
+// are dropped.
+static PangoFontDescription *get_font_description(const char *font) {
+	if (!cache.font || strcmp(cache.font, font) != 0) {
+		for (size_t i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+			free(cache.layouts[i].text);
+			cache.layouts[i].text = NULL;
+			cache.layouts[i].used = 0;
+		}
+		free(cache.font);
+		if (cache.desc) {
+			pango_font_description_free(cache.desc);
+		}
+		cache.font = strdup(font);
+		if (!cache.font) {
+			fprintf(stderr, "could not strdup %zu bytes", strlen(font) + 1);
+			exit(EXIT_FAILURE);
+		}
+		cache.desc = pango_font_description_from_string(font);
+	}
+	return cache.desc;
+}
+
 int get_font_height(const char *fontstr) {
 	PangoFontMap *fontmap = pango_cairo_font_map_get_default();
 	PangoContext *context = pango_font_map_create_context(fontmap);
-	PangoFontDescription *desc = pango_font_description_from_string(fontstr);
+	PangoFontDescription *desc = get_font_description(fontstr);
 	PangoFont *font = pango_font_map_load_font(fontmap, context, desc);
 	if (font == NULL) {
 		return -1;
 	}
 	PangoFontMetrics *metrics = pango_font_get_metrics(font, NULL);
 	int height = pango_font_metrics_get_height(metrics) / PANGO_SCALE;
-	pango_font_description_free(desc);
 	pango_font_metrics_unref(metrics);
 	return height;
 }
 
-PangoLayout *get_pango_layout(cairo_t *cairo, const char *font,
-		const char *text, double scale) {
-	PangoLayout *layout = pango_cairo_create_layout(cairo);
+static void set_layout_text(PangoLayout *layout, const char *font,
+		const char *text, int len, double scale) {
 	PangoAttrList *attrs = pango_attr_list_new();
-	pango_layout_set_text(layout, text, -1);
+	pango_layout_set_text(layout, text, len);
 	pango_attr_list_insert(attrs, pango_attr_scale_new(scale));
-	PangoFontDescription *desc = pango_font_description_from_string(font);
-	pango_layout_set_font_description(layout, desc);
+	pango_layout_set_font_description(layout, get_font_description(font));
 	pango_layout_set_single_paragraph_mode(layout, 1);
 	pango_layout_set_attributes(layout, attrs);
 	pango_attr_list_unref(attrs);
-	pango_font_description_free(desc);
+}
+
+PangoLayout *get_pango_layout(cairo_t *cairo, const char *font,
+		const char *text, double scale) {
+	PangoLayout *layout = pango_cairo_create_layout(cairo);
+	set_layout_text(layout, font, text, -1, scale);
 	return layout;
 }
 
+// Updates the shared context for the cairo context. Updating it re-shapes
+// every cached layout, so it is done only if the font options or the
+// transformation differ from the last ones.
+static void update_context(cairo_t *cairo) {
+	cairo_font_options_t *options = cairo_font_options_create();
+	cairo_surface_get_font_options(cairo_get_target(cairo), options);
+	cairo_font_options_t *own = cairo_font_options_create();
+	cairo_get_font_options(cairo, own);
+	cairo_font_options_merge(options, own);
+	cairo_font_options_destroy(own);
+	cairo_matrix_t matrix;
+	cairo_get_matrix(cairo, &matrix);
+
+	if (!cache.context) {
+		cache.context = pango_cairo_create_context(cairo);
+	} else if (!cairo_font_options_equal(options, cache.options)
+			|| memcmp(&matrix, &cache.matrix, sizeof matrix) != 0) {
+		pango_cairo_update_context(cairo, cache.context);
+		for (size_t i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+			if (cache.layouts[i].layout) {
+				pango_layout_context_changed(cache.layouts[i].layout);
+			}
+		}
+	}
+	if (cache.options) {
+		cairo_font_options_destroy(cache.options);
+	}
+	cache.options = options;
+	cache.matrix = matrix;
+}
+
+static uint64_t hash_text(const char *text, int len) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (int i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)text[i]) * 0x100000001b3;
+	}
+	return hash;
+}
+
+// Returns the layout of the first len bytes of the text, or of all of it if
+// len is negative, shaping it only if it is not among the recently used ones.
+// The layout belongs to the cache and stays valid until the next call.
+static PangoLayout *get_cached_layout(cairo_t *cairo, const char *font,
+		const char *text, int len, double scale) {
+	update_context(cairo);
+	get_font_description(font);
+
+	if (len < 0) {
+		len = strlen(text);
+	}
+	uint64_t hash = hash_text(text, len);
+	struct cached_layout *victim = &cache.layouts[0];
+	for (size_t i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+		struct cached_layout *entry = &cache.layouts[i];
+		if (entry->text && entry->hash == hash && entry->scale == scale
+				&& entry->len == len && memcmp(entry->text, text, len) == 0) {
+			entry->used = ++cache.clock;
+			return entry->layout;
+		}
+		if (entry->used < victim->used) {
+			victim = entry;
+		}
+	}
+
+	char *copy = malloc(len + 1);
+	if (!copy) {
+		fprintf(stderr, "could not malloc %d bytes", len + 1);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(copy, text, len);
+	copy[len] = '\0';
+	free(victim->text);
+	victim->text = copy;
+	victim->len = len;
+	victim->hash = hash;
+	victim->scale = scale;
+	victim->used = ++cache.clock;
+	if (!victim->layout) {
+		victim->layout = pango_layout_new(cache.context);
+	}
+	set_layout_text(victim->layout, font, copy, len, scale);
+	return victim->layout;
+}
+
 void get_text_size(cairo_t *cairo, const char *font, int *width, int *height,
-		int *baseline, double scale, const char *text) {
-	PangoLayout *layout = get_pango_layout(cairo, font, text, scale);
-	pango_cairo_update_layout(cairo, layout);
+		int *baseline, double scale, const char *text, int len) {
+	PangoLayout *layout = get_cached_layout(cairo, font, text, len, scale);
 	pango_layout_get_pixel_size(layout, width, height);
 	if (baseline) {
 		*baseline = pango_layout_get_baseline(layout) / PANGO_SCALE;
 	}
-	g_object_unref(layout);
 }
 
-int text_width(cairo_t *cairo, const char *font, const char *text) {
+int text_width(cairo_t *cairo, const char *font, const char *text, int len) {
 	int text_width;
-	get_text_size(cairo, font, &text_width, NULL, NULL, 1, text);
+	get_text_size(cairo, font, &text_width, NULL, NULL, 1, text, len);
 	return text_width;
 }
 
-void pango_printf(cairo_t *cairo, const char *font, double scale,
-		const char *text) {
-	PangoLayout *layout = get_pango_layout(cairo, font, text, scale);
-	cairo_font_options_t *fo = cairo_font_options_create();
-	cairo_get_font_options(cairo, fo);
-	pango_cairo_context_set_font_options(pango_layout_get_context(layout), fo);
-	cairo_font_options_destroy(fo);
+// Returns the x position of the cursor at the byte index of the text, taken
+// from the same layout the text is drawn with.
+int cursor_x(cairo_t *cairo, const char *font, const char *text, size_t index) {
+	PangoLayout *layout = get_cached_layout(cairo, font, text, -1, 1);
+	PangoRectangle pos;
+	pango_layout_get_cursor_pos(layout, index, &pos, NULL);
+	return PANGO_PIXELS(pos.x);
+}
+
+// Returns whether the font is of a monospace family, whose advances do not
+// change with kerning or ligatures.
+static bool is_monospace(PangoContext *context, const char *font) {
+	PangoFont *loaded = pango_context_load_font(context,
+			get_font_description(font));
+	if (!loaded) {
+		return false;
+	}
+	PangoFontFace *face = pango_font_get_face(loaded);
+	bool monospace = face
+		&& pango_font_family_is_monospace(pango_font_face_get_family(face));
+	g_object_unref(loaded);
+	return monospace;
+}
+
+// Gets the advances of the printable ASCII characters in Pango units, laying
+// them out one at a time. Other characters get no advance, and neither does
+// any character of a font which is not monospace, since the width of its text
+// is not the sum of the advances once it is shaped.
+void get_ascii_advances(cairo_t *cairo, const char *font, int advances[128]) {
+	PangoLayout *layout = get_pango_layout(cairo, font, "", 1);
 	pango_cairo_update_layout(cairo, layout);
-	pango_cairo_show_layout(cairo, layout);
+	bool monospace = is_monospace(pango_layout_get_context(layout), font);
+	char text[2] = {0};
+	for (int c = 0; c < 128; c++) {
+		advances[c] = 0;
+		if (monospace && c >= ' ' && c <= '~') {
+			text[0] = c;
+			pango_layout_set_text(layout, text, 1);
+			pango_layout_get_size(layout, &advances[c], NULL);
+		}
+	}
 	g_object_unref(layout);
 }
+
+// Returns a description of the font the given one resolves to, along with the
+// size, glyph count and units per em of its face, so that widths measured
+// with it are not mistaken for those of another font or of another version
+// of it. The string is to be freed by the caller.
+char *get_font_identity(cairo_t *cairo, const char *font) {
+	PangoLayout *layout = get_pango_layout(cairo, font, "", 1);
+	pango_cairo_update_layout(cairo, layout);
+	PangoFont *loaded = pango_context_load_font(pango_layout_get_context(layout),
+			get_font_description(font));
+	g_object_unref(layout);
+	if (!loaded) {
+		char *identity = strdup(font);
+		if (!identity) {
+			fprintf(stderr, "could not strdup %zu bytes", strlen(font) + 1);
+			exit(EXIT_FAILURE);
+		}
+		return identity;
+	}
+
+	PangoFontDescription *desc = pango_font_describe_with_absolute_size(loaded);
+	char *name = pango_font_description_to_string(desc);
+	hb_face_t *face = hb_font_get_face(pango_font_get_hb_font(loaded));
+	hb_blob_t *blob = hb_face_reference_blob(face);
+	size_t size = snprintf(NULL, 0, "%s %u %u %u", name,
+			hb_blob_get_length(blob), hb_face_get_glyph_count(face),
+			hb_face_get_upem(face)) + 1;
+	char *identity = malloc(size);
+	if (!identity) {
+		fprintf(stderr, "could not malloc %zu bytes", size);
+		exit(EXIT_FAILURE);
+	}
+	snprintf(identity, size, "%s %u %u %u", name, hb_blob_get_length(blob),
+			hb_face_get_glyph_count(face), hb_face_get_upem(face));
+	hb_blob_destroy(blob);
+	g_free(name);
+	pango_font_description_free(desc);
+	g_object_unref(loaded);
+	return identity;
+}
+
+void pango_printf(cairo_t *cairo, const char *font, double scale,
+		const char *text, int len) {
+	PangoLayout *layout = get_cached_layout(cairo, font, text, len, scale);
+	pango_cairo_show_layout(cairo, layout);
+}
@@ -8,9 +8,12 @@ int get_font_height(const char *font);
 PangoLayout *get_pango_layout(cairo_t *cairo, const char *font,
 		const char *text, double scale);
 void get_text_size(cairo_t *cairo, const char *font, int *width, int *height,
-		int *baseline, double scale, const char *text);
-int text_width(cairo_t *cairo, const char *font, const char *text);
+		int *baseline, double scale, const char *text, int len);
+int text_width(cairo_t *cairo, const char *font, const char *text, int len);
+int cursor_x(cairo_t *cairo, const char *font, const char *text, size_t index);
+void get_ascii_advances(cairo_t *cairo, const char *font, int advances[128]);
+char *get_font_identity(cairo_t *cairo, const char *font);
 void pango_printf(cairo_t *cairo, const char *font, double scale,
-		const char *text);
+		const char *text, int len);
 
 #endif
@@ -1,9 +1,43 @@
 #include <cairo/cairo.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "render.h"
 
 #include "menu.h"
 #include "pango.h"
+#include "width-cache.h"
+
+// Number of items whose widths the input area width is estimated from
+#ifndef INPUT_WIDTH_ITEMS
+#define INPUT_WIDTH_ITEMS 256
+#endif
+
+// Number of items from which measuring is split across threads
+#ifndef PARALLEL_WIDTH_ITEMS
+#define PARALLEL_WIDTH_ITEMS 1024
+#endif
+
+// Most memory the rendered items kept may take
+#ifndef ITEM_CACHE_BYTES
+#define ITEM_CACHE_BYTES (16 << 20)
+#endif
+
+// Returns the context the calling thread measures text with. Items are
+// measured by both the event thread and the matching thread while buffers may
+// be busy, so each thread measures them on a surface of its own, kept until
+// exit. It is an image surface like the buffers, so that text is measured
+// with the font options it is drawn with.
+static cairo_t *measure_cairo(void) {
+	static _Thread_local cairo_t *cairo;
+	if (!cairo) {
+		cairo = cairo_create(cairo_image_surface_create(
+				CAIRO_FORMAT_ARGB32, 1, 1));
+	}
+	return cairo;
+}
 
 // Calculate text widths.
 void calc_widths(struct menu *menu) {
@@ -11,22 +45,132 @@ void calc_widths(struct menu *menu) {
 
 	// Calculate prompt width
 	if (menu->prompt) {
-		menu->promptw = text_width(cairo, menu->font, menu->prompt) + menu->padding + menu->padding/2;
+		menu->promptw = text_width(cairo, menu->font, menu->prompt, -1) + menu->padding + menu->padding/2;
 	} else {
 		menu->promptw = 0;
 	}
 
 	// Calculate scroll indicator widths
-	menu->left_arrow = text_width(cairo, menu->font, "<") + 2 * menu->padding;
-	menu->right_arrow = text_width(cairo, menu->font, ">") + 2 * menu->padding;
-
-	// Calculate item widths and input area width
-	for (struct item *item = menu->items; item; item = item->next) {
-		item->width = text_width(cairo, menu->font, item->text);
-		if (item->width > menu->inputw) {
-			menu->inputw = item->width;
+	menu->left_arrow = text_width(cairo, menu->font, "<", -1) + 2 * menu->padding;
+	menu->right_arrow = text_width(cairo, menu->font, ">", -1) + 2 * menu->padding;
+
+	// Vertical menus never measure items, so they need neither the cached
+	// widths nor the advances to estimate them with.
+	if (menu->lines > 0) {
+		return;
+	}
+	char *identity = get_font_identity(measure_cairo(), menu->font);
+	menu->width_cache = width_cache_open(identity);
+	free(identity);
+	get_ascii_advances(measure_cairo(), menu->font, menu->ascii_advances);
+	calc_item_widths(menu, 0);
+}
+
+// Returns the length of the item text, which is not NUL-terminated, as Pango
+// takes it.
+static int item_len(struct menu *menu, uint32_t item) {
+	return MIN(menu->items.text_len[item], INT_MAX);
+}
+
+// Estimates the width of printable ASCII text in a monospace font by summing
+// the advances of its characters, which needs no shaping. Returns -1 for any
+// other text, or for any text in another font.
+static int estimate_width(struct menu *menu, const char *text, int len) {
+	int64_t width = 0;
+	for (int i = 0; i < len; i++) {
+		unsigned char c = text[i];
+		if (c >= 128 || menu->ascii_advances[c] == 0) {
+			return -1;
 		}
+		width += menu->ascii_advances[c];
 	}
+	return (width + PANGO_SCALE - 1) / PANGO_SCALE;
+}
+
+// Measures the item text, unless it can be estimated or an earlier run
+// already measured it.
+static int measure_item(struct menu *menu, const char *text, int len) {
+	int width = estimate_width(menu, text, len);
+	if (width >= 0 || width_cache_get(menu->width_cache, text, len, &width)) {
+		return width;
+	}
+	width = text_width(measure_cairo(), menu->font, text, len);
+	width_cache_put(menu->width_cache, text, len, width);
+	return width;
+}
+
+// Estimate the input area width from the widths of the first items, starting
+// with the given new item. It takes at most a third of the menu width. Other
+// items are measured once they are paged, and vertical menus have no input
+// area before the items, so they measure none.
+void calc_item_widths(struct menu *menu, size_t start) {
+	struct items *items = &menu->new_items;
+	size_t first = menu->nitems - items->len;
+	if (menu->lines > 0 || first + start >= INPUT_WIDTH_ITEMS) {
+		return;
+	}
+
+	size_t end = MIN(items->len, INPUT_WIDTH_ITEMS - first);
+	for (size_t i = start; i < end; i++) {
+		items->width[i] = measure_item(menu, items->text[i],
+				MIN(items->text_len[i], INT_MAX));
+		if (items->width[i] > menu->inputw) {
+			menu->inputw = MIN(items->width[i], menu->width / 3);
+		}
+	}
+}
+
+// Returns the width of the item, measuring it if needed.
+int item_width(struct menu *menu, uint32_t item) {
+	if (menu->items.width[item] < 0) {
+		menu->items.width[item] = measure_item(menu, menu->items.text[item],
+				item_len(menu, item));
+	}
+	return menu->items.width[item];
+}
+
+// A range of items to be measured by a worker thread.
+struct measure_job {
+	struct menu *menu;
+	uint32_t *items;
+	size_t len;
+};
+
+// Measures a range of items. Each thread of the pool measures with its own
+// context and layouts, as Pango is not thread-safe.
+static void measure_chunk(void *data) {
+	struct measure_job *job = data;
+	for (size_t i = 0; i < job->len; i++) {
+		item_width(job->menu, job->items[i]);
+	}
+}
+
+// Measures the given items, which are not yet measured. Many items are split
+// into a range for each thread of the pool.
+void measure_items(struct menu *menu, uint32_t *items, size_t len) {
+	if (len < PARALLEL_WIDTH_ITEMS || menu->threads < 2) {
+		for (size_t i = 0; i < len; i++) {
+			item_width(menu, items[i]);
+		}
+		return;
+	}
+
+	size_t njobs = menu->threads;
+	struct measure_job *jobs = calloc(njobs, sizeof *jobs);
+	if (!jobs) {
+		for (size_t i = 0; i < len; i++) {
+			item_width(menu, items[i]);
+		}
+		return;
+	}
+	size_t chunk = (len + njobs - 1) / njobs;
+	for (size_t i = 0; i < njobs; i++) {
+		jobs[i].menu = menu;
+		jobs[i].items = items + MIN(i * chunk, len);
+		jobs[i].len = MIN(chunk, len - MIN(i * chunk, len));
+	}
+	thread_pool_run(menu->thread_pool, measure_chunk, jobs, sizeof *jobs, njobs);
+	free(jobs);
 }
 
 static void cairo_set_source_u32(cairo_t *cairo, uint32_t color) {
@@ -37,13 +181,13 @@ static void cairo_set_source_u32(cairo_t *cairo, uint32_t color) {
 		(color >> (0*8) & 0xFF) / 255.0);
 }
 
-// Renders text to cairo.
+// Renders text to cairo. A negative length renders all of the string.
 static int render_text(struct menu *menu, cairo_t *cairo, const char *str,
-		int x, int y, int width, uint32_t bg_color, uint32_t fg_color,
+		int len, int x, int y, int width, uint32_t bg_color, uint32_t fg_color,
 		int left_padding, int right_padding) {
 
 	int text_width, text_height;
-	get_text_size(cairo, menu->font, &text_width, &text_height, NULL, 1, str);
+	get_text_size(cairo, menu->font, &text_width, &text_height, NULL, 1, str, len);
 	int text_y = (menu->line_height / 2.0) - (text_height / 2.0);
 
 	if (width == 0) {
@@ -56,7 +200,7 @@ static int render_text(struct menu *menu, cairo_t *cairo, const char *str,
 	}
 	cairo_move_to(cairo, x + left_padding, y + text_y);
 	cairo_set_source_u32(cairo, fg_color);
-	pango_printf(cairo, menu->font, 1, str);
+	pango_printf(cairo, menu->font, 1, str, len);
 
 	return width;
 }
@@ -66,13 +210,13 @@ static void render_prompt(struct menu *menu, cairo_t *cairo) {
 	if (!menu->prompt) {
 		return;
 	}
-	render_text(menu, cairo, menu->prompt, 0, 0, 0,
+	render_text(menu, cairo, menu->prompt, -1, 0, 0, 0,
 		menu->promptbg, menu->promptfg, menu->padding, menu->padding/2);
 }
 
 // Renders the input text.
 static void render_input(struct menu *menu, cairo_t *cairo) {
-	render_text(menu, cairo, menu->input, menu->promptw, 0, 0,
+	render_text(menu, cairo, menu->input, -1, menu->promptw, 0, 0,
 		0, menu->foreground, menu->padding, menu->padding);
 }
 
@@ -81,56 +225,183 @@ static void render_cursor(struct menu *menu, cairo_t *cairo) {
 	const int cursor_width = 2;
 	const int cursor_margin = 2;
 	int cursor_pos = menu->promptw + menu->padding
-		+ text_width(cairo, menu->font, menu->input)
-		- text_width(cairo, menu->font, &menu->input[menu->cursor])
+		+ cursor_x(cairo, menu->font, menu->input, menu->cursor)
 		- cursor_width / 2;
 	cairo_rectangle(cairo, cursor_pos, cursor_margin, cursor_width,
 			menu->line_height - 2 * cursor_margin);
 	cairo_fill(cairo);
 }
 
+static void free_strip(struct menu *menu, struct item_strip *strip) {
+	cairo_surface_destroy(strip->surface);
+	menu->strips_size -= strip->size;
+	strip->surface = NULL;
+	strip->used = 0;
+}
+
+// Frees the rendered items.
+void free_strips(struct menu *menu) {
+	for (size_t i = 0; i < ITEM_CACHE_SIZE; i++) {
+		if (menu->strips[i].surface) {
+			free_strip(menu, &menu->strips[i]);
+		}
+	}
+}
+
+// Returns a free buffer to draw into. The rendered items are freed along with
+// buffers drawn at another scale, as they cannot be composited into new ones.
+static struct pool_buffer *next_buffer(struct menu *menu, int32_t scale) {
+	for (size_t i = 0; i < 2; i++) {
+		if (menu->buffers[i].buffer && menu->buffers[i].scale != scale) {
+			free_strips(menu);
+			break;
+		}
+	}
+	return get_next_buffer(menu->shm, menu->buffers,
+		menu->width, menu->height, scale);
+}
+
+// Returns the item rendered on a background of its own, rendering it only if
+// it is not among the recently used ones. Returns NULL if it cannot be kept.
+static struct item_strip *get_strip(struct menu *menu, cairo_t *cairo,
+		uint32_t item, int right_padding) {
+	bool selected = menu->sel == item;
+	int scale = menu->output ? menu->output->scale : 1;
+	struct item_strip *victim = &menu->strips[0];
+	for (size_t i = 0; i < ITEM_CACHE_SIZE; i++) {
+		struct item_strip *strip = &menu->strips[i];
+		if (strip->surface && strip->item == item
+				&& strip->selected == selected && strip->scale == scale) {
+			strip->used = ++menu->strips_clock;
+			return strip;
+		}
+		if (strip->used < victim->used) {
+			victim = strip;
+		}
+	}
+
+	const char *text = menu->items.text[item];
+	int len = item_len(menu, item);
+	int width = text_width(cairo, menu->font, text, len) + menu->padding + right_padding;
+	size_t size = (size_t)width * scale * menu->line_height * scale * 4;
+	if (size > ITEM_CACHE_BYTES) {
+		return NULL;
+	}
+	if (victim->surface) {
+		free_strip(menu, victim);
+	}
+	while (menu->strips_size + size > ITEM_CACHE_BYTES) {
+		struct item_strip *oldest = NULL;
+		for (size_t i = 0; i < ITEM_CACHE_SIZE; i++) {
+			struct item_strip *strip = &menu->strips[i];
+			if (strip->surface && (!oldest || strip->used < oldest->used)) {
+				oldest = strip;
+			}
+		}
+		free_strip(menu, oldest);
+	}
+
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+			width * scale, menu->line_height * scale);
+	if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surface);
+		return NULL;
+	}
+	cairo_surface_set_device_scale(surface, scale, scale);
+	cairo_t *strip_cairo = cairo_create(surface);
+	cairo_set_antialias(strip_cairo, CAIRO_ANTIALIAS_BEST);
+	cairo_set_operator(strip_cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_u32(strip_cairo, menu->background);
+	cairo_paint(strip_cairo);
+	render_text(menu, strip_cairo, text, len, 0, 0, width,
+		selected ? menu->selectionbg : menu->background,
+		selected ? menu->selectionfg : menu->foreground,
+		menu->padding, right_padding);
+	cairo_destroy(strip_cairo);
+
+	victim->surface = surface;
+	victim->item = item;
+	victim->selected = selected;
+	victim->scale = scale;
+	victim->width = width;
+	victim->size = size;
+	victim->used = ++menu->strips_clock;
+	menu->strips_size += size;
+	return victim;
+}
+
+// Composites a rendered item at the given position.
+static void paint_strip(struct menu *menu, cairo_t *cairo,
+		struct item_strip *strip, int x, int y) {
+	cairo_set_source_surface(cairo, strip->surface, x, y);
+	cairo_rectangle(cairo, x, y, strip->width, menu->line_height);
+	cairo_fill(cairo);
+}
+
 // Renders a single menu item horizontally.
-static int render_horizontal_item(struct menu *menu, cairo_t *cairo, struct item *item, int x) {
+static int render_horizontal_item(struct menu *menu, cairo_t *cairo, uint32_t item, int x) {
 	uint32_t bg_color = menu->sel == item ? menu->selectionbg : menu->background;
 	uint32_t fg_color = menu->sel == item ? menu->selectionfg : menu->foreground;
 
-	return render_text(menu, cairo, item->text, x, 0, 0,
+	struct item_strip *strip = get_strip(menu, cairo, item, menu->padding);
+	if (strip) {
+		paint_strip(menu, cairo, strip, x, 0);
+		return strip->width;
+	}
+	return render_text(menu, cairo, menu->items.text[item],
+		item_len(menu, item), x, 0, 0,
 		bg_color, fg_color, menu->padding, menu->padding);
 }
 
-// Renders a single menu item vertically.
-static int render_vertical_item(struct menu *menu, cairo_t *cairo, struct item *item, int x, int y) {
+// Renders a single menu item vertically. Only the text is kept rendered, as
+// the rest of the row is plain background.
+static int render_vertical_item(struct menu *menu, cairo_t *cairo, uint32_t item, int x, int y) {
 	uint32_t bg_color = menu->sel == item ? menu->selectionbg : menu->background;
 	uint32_t fg_color = menu->sel == item ? menu->selectionfg : menu->foreground;
 
-	render_text(menu, cairo, item->text, x, y, menu->width - x,
+	struct item_strip *strip = get_strip(menu, cairo, item, 0);
+	if (strip) {
+		if (bg_color) {
+			cairo_set_source_u32(cairo, bg_color);
+			cairo_rectangle(cairo, x, y, menu->width - x, menu->line_height);
+			cairo_fill(cairo);
+		}
+		paint_strip(menu, cairo, strip, x, y);
+		return menu->line_height;
+	}
+	render_text(menu, cairo, menu->items.text[item],
+		item_len(menu, item), x, y, menu->width - x,
 		bg_color, fg_color, menu->padding, 0);
 	return menu->line_height;
 }
 
 // Renders a page of menu items horizontally.
-static void render_horizontal_page(struct menu *menu, cairo_t *cairo, struct page *page) {
+static void render_horizontal_page(struct menu *menu, cairo_t *cairo, size_t page) {
+	uint32_t *next_match = menu->items.next_match;
+	uint32_t end = next_match[menu->pages[page].last];
 	int x = menu->promptw + menu->inputw + menu->left_arrow;
-	for (struct item *item = page->first; item != page->last->next_match; item = item->next_match) {
+	for (uint32_t item = menu->pages[page].first; item != end; item = next_match[item]) {
 		x += render_horizontal_item(menu, cairo, item, x);
 	}
 
 	// Draw left and right scroll indicators if necessary
-	if (page->prev) {
+	if (page > 0) {
 		cairo_move_to(cairo, menu->promptw + menu->inputw + menu->padding, 0);
-		pango_printf(cairo, menu->font, 1, "<");
+		pango_printf(cairo, menu->font, 1, "<", -1);
 	}
-	if (page->next) {
+	if (next_match[menu->pages[page].last] != NO_ITEM) {
 		cairo_move_to(cairo, menu->width - menu->right_arrow + menu->padding, 0);
-		pango_printf(cairo, menu->font, 1, ">");
+		pango_printf(cairo, menu->font, 1, ">", -1);
 	}
 }
 
 // Renders a page of menu items vertically.
-static void render_vertical_page(struct menu *menu, cairo_t *cairo, struct page *page) {
+static void render_vertical_page(struct menu *menu, cairo_t *cairo, size_t page) {
+	uint32_t *next_match = menu->items.next_match;
+	uint32_t end = next_match[menu->pages[page].last];
 	int x = menu->promptw;
 	int y = menu->line_height;
-	for (struct item *item = page->first; item != page->last->next_match; item = item->next_match) {
+	for (uint32_t item = menu->pages[page].first; item != end; item = next_match[item]) {
 		y += render_vertical_item(menu, cairo, item, x, y);
 	}
 }
@@ -148,52 +419,228 @@ static void render_to_cairo(struct menu *menu, cairo_t *cairo) {
 	render_cursor(menu, cairo);
 
 	// Render selected page
-	if (!menu->sel) {
+	if (menu->sel == NO_ITEM) {
 		return;
 	}
 	if (menu->lines > 0) {
-		render_vertical_page(menu, cairo, menu->sel->page);
+		render_vertical_page(menu, cairo, menu->items.page[menu->sel]);
+	} else {
+		render_horizontal_page(menu, cairo, menu->items.page[menu->sel]);
+	}
+}
+
+// Regions of the surface to be redrawn, in surface coordinates.
+struct damage {
+	struct {
+		int x, y, width, height;
+	} rects[3];
+	size_t len;
+};
+
+static void add_damage(struct damage *damage, int x, int y, int width, int height) {
+	damage->rects[damage->len].x = x;
+	damage->rects[damage->len].y = y;
+	damage->rects[damage->len].width = width;
+	damage->rects[damage->len].height = height;
+	damage->len++;
+}
+
+// Returns the right edge of the input text.
+static int input_right(struct menu *menu, cairo_t *cairo) {
+	return menu->promptw + text_width(cairo, menu->font, menu->input, -1)
+		+ 2 * menu->padding;
+}
+
+// Adds the rectangle of an item on the page of the selected item.
+static void damage_item(struct menu *menu, cairo_t *cairo,
+		struct damage *damage, uint32_t item) {
+	uint32_t *next_match = menu->items.next_match;
+	uint32_t first = menu->pages[menu->items.page[item]].first;
+	if (menu->lines > 0) {
+		int y = menu->line_height;
+		for (uint32_t i = first; i != item; i = next_match[i]) {
+			y += menu->line_height;
+		}
+		add_damage(damage, menu->promptw, y,
+			menu->width - menu->promptw, menu->line_height);
 	} else {
-		render_horizontal_page(menu, cairo, menu->sel->page);
+		int x = menu->promptw + menu->inputw + menu->left_arrow;
+		for (uint32_t i = first; i != item; i = next_match[i]) {
+			x += text_width(cairo, menu->font, menu->items.text[i],
+					item_len(menu, i))
+				+ 2 * menu->padding;
+		}
+		add_damage(damage, x, 0, text_width(cairo, menu->font,
+				menu->items.text[item], item_len(menu, item)) + 2 * menu->padding,
+			menu->line_height);
+	}
+}
+
+// Gets the regions which differ between a frame and the current state: the
+// input line, and either the old and new selected items or, if the page
+// changed, all the items. Without a frame, everything differs.
+static void get_damage(struct menu *menu, cairo_t *cairo,
+		struct frame *frame, struct pool_buffer *buffer, struct damage *damage) {
+	damage->len = 0;
+	if (!frame || !frame->buffer
+			|| frame->width != buffer->width || frame->height != buffer->height
+			|| frame->scale != buffer->scale || frame->promptw != menu->promptw
+			|| frame->inputw != menu->inputw) {
+		add_damage(damage, 0, 0, menu->width, menu->height);
+		return;
+	}
+
+	int right = input_right(menu, cairo);
+	if (frame->cursor != menu->cursor || strcmp(frame->input, menu->input) != 0) {
+		int input_end = MAX(menu->promptw + menu->inputw, MAX(right, frame->input_right));
+		add_damage(damage, menu->promptw, 0,
+			input_end - menu->promptw, menu->line_height);
+	}
+
+	if (frame->relinks == menu->relinks && frame->sel == menu->sel) {
+		return;
+	}
+	if (frame->relinks != menu->relinks || frame->sel == NO_ITEM
+			|| menu->sel == NO_ITEM
+			|| menu->items.page[frame->sel] != menu->items.page[menu->sel]) {
+		if (menu->lines > 0) {
+			add_damage(damage, 0, menu->line_height,
+				menu->width, menu->height - menu->line_height);
+		} else {
+			int x = menu->promptw + menu->inputw;
+			add_damage(damage, x, 0, menu->width - x, menu->line_height);
+		}
+		return;
+	}
+	damage_item(menu, cairo, damage, frame->sel);
+	damage_item(menu, cairo, damage, menu->sel);
+}
+
+// Records the current state as the one the buffer shows.
+static void save_frame(struct menu *menu, cairo_t *cairo,
+		struct frame *frame, struct pool_buffer *buffer) {
+	frame->buffer = buffer->buffer;
+	frame->width = buffer->width;
+	frame->height = buffer->height;
+	frame->scale = buffer->scale;
+	frame->promptw = menu->promptw;
+	frame->inputw = menu->inputw;
+	strcpy(frame->input, menu->input);
+	frame->cursor = menu->cursor;
+	frame->input_right = input_right(menu, cairo);
+	frame->sel = menu->sel;
+	frame->relinks = menu->relinks;
+}
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+	struct menu *menu = data;
+	wl_callback_destroy(callback);
+	menu->frame_callback = NULL;
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_done,
+};
+
+// Marks the menu to be drawn. The event loop draws it once the compositor
+// has shown the last frame, so bursts of changes make a single frame.
+void schedule_frame(struct menu *menu) {
+	menu->dirty = true;
+}
+
+// Attaches the current buffer to the surface and commits it, reporting the
+// damaged regions in buffer coordinates, and asks to be told when it is shown.
+static void commit_buffer(struct menu *menu, int scale, struct damage *damage) {
+	if (!menu->frame_callback) {
+		menu->frame_callback = wl_surface_frame(menu->surface);
+		wl_callback_add_listener(menu->frame_callback, &frame_listener, menu);
+	}
+	wl_surface_set_buffer_scale(menu->surface, scale);
+	wl_surface_attach(menu->surface, menu->current->buffer, 0, 0);
+	for (size_t i = 0; i < damage->len; i++) {
+		wl_surface_damage_buffer(menu->surface,
+			damage->rects[i].x * scale, damage->rects[i].y * scale,
+			damage->rects[i].width * scale, damage->rects[i].height * scale);
 	}
+	wl_surface_commit(menu->surface);
 }
 
-// Renders a single frame of the menu.
+// Renders a single frame of the menu straight into a free buffer, redrawing
+// only what changed since the buffer was last drawn. While the compositor
+// holds both buffers, the frame is recorded instead and shown by
+// render_pending() once one of them is released.
 void render_menu(struct menu *menu) {
-	cairo_surface_t *recorder = cairo_recording_surface_create(
-			CAIRO_CONTENT_COLOR_ALPHA, NULL);
-	cairo_t *cairo = cairo_create(recorder);
-	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
-	cairo_font_options_t *fo = cairo_font_options_create();
-	cairo_set_font_options(cairo, fo);
-	cairo_font_options_destroy(fo);
-	cairo_save(cairo);
-	cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
-	cairo_paint(cairo);
-	cairo_restore(cairo);
+	menu->dirty = false;
+	int scale = menu->output ? menu->output->scale : 1;
+	struct pool_buffer *buffer = next_buffer(menu, scale);
+	if (menu->pending) {
+		cairo_surface_destroy(menu->pending);
+		menu->pending = NULL;
+	}
 
-	render_to_cairo(menu, cairo);
+	if (!buffer) {
+		menu->pending = cairo_recording_surface_create(
+				CAIRO_CONTENT_COLOR_ALPHA, NULL);
+		cairo_t *cairo = cairo_create(menu->pending);
+		cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
+		render_to_cairo(menu, cairo);
+		cairo_destroy(cairo);
+		return;
+	}
+
+	menu->current = buffer;
+	cairo_t *cairo = buffer->cairo;
+	struct frame *frame = &menu->frames[buffer - menu->buffers];
+	struct damage redraw, report;
+	/* redraw what changed since the buffer was drawn */
+	get_damage(menu, cairo, frame->buffer == buffer->buffer ? frame : NULL,
+		buffer, &redraw);
+	/* report what changed since the last commit, which may be the other buffer */
+	get_damage(menu, cairo, menu->shown, buffer, &report);
+
+	if (redraw.len > 0) {
+		cairo_save(cairo);
+		for (size_t i = 0; i < redraw.len; i++) {
+			cairo_rectangle(cairo, redraw.rects[i].x, redraw.rects[i].y,
+				redraw.rects[i].width, redraw.rects[i].height);
+		}
+		cairo_clip(cairo);
+		cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
+		render_to_cairo(menu, cairo);
+		cairo_restore(cairo);
+	}
+	save_frame(menu, cairo, frame, buffer);
+	menu->shown = frame;
+
+	commit_buffer(menu, scale, &report);
+}
 
+// Shows the frame recorded while both buffers were busy, if one is free now.
+void render_pending(struct menu *menu) {
+	if (!menu->pending) {
+		return;
+	}
 	int scale = menu->output ? menu->output->scale : 1;
-	menu->current = get_next_buffer(menu->shm,
-		menu->buffers, menu->width, menu->height, scale);
-	if (!menu->current) {
-		goto cleanup;
+	struct pool_buffer *buffer = next_buffer(menu, scale);
+	if (!buffer) {
+		return;
 	}
 
-	cairo_t *shm = menu->current->cairo;
+	menu->current = buffer;
+	cairo_t *shm = buffer->cairo;
 	cairo_save(shm);
-	cairo_set_operator(shm, CAIRO_OPERATOR_CLEAR);
+	cairo_set_operator(shm, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(shm, menu->pending, 0, 0);
 	cairo_paint(shm);
 	cairo_restore(shm);
-	cairo_set_source_surface(shm, recorder, 0, 0);
-	cairo_paint(shm);
-
-	wl_surface_set_buffer_scale(menu->surface, scale);
-	wl_surface_attach(menu->surface, menu->current->buffer, 0, 0);
-	wl_surface_damage(menu->surface, 0, 0, menu->width, menu->height);
-	wl_surface_commit(menu->surface);
+	cairo_surface_destroy(menu->pending);
+	menu->pending = NULL;
 
-cleanup:
-	cairo_destroy(cairo);
+	/* the state may have changed since the recording, so the next frame
+	 * is redrawn and reported in full */
+	menu->frames[buffer - menu->buffers].buffer = NULL;
+	menu->shown = NULL;
+	struct damage damage = { .len = 0 };
+	add_damage(&damage, 0, 0, menu->width, menu->height);
+	commit_buffer(menu, scale, &damage);
 }
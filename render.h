@@ -4,6 +4,12 @@
 #include "menu.h"
 
 void calc_widths(struct menu *menu);
+void calc_item_widths(struct menu *menu, size_t start);
+int item_width(struct menu *menu, uint32_t item);
+void measure_items(struct menu *menu, uint32_t *items, size_t len);
+void schedule_frame(struct menu *menu);
 void render_menu(struct menu *menu);
+void render_pending(struct menu *menu);
+void free_strips(struct menu *menu);
 
 #endif
@@ -0,0 +1,136 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "search.h"
+
+// Candidate positions are found by comparing a block of the haystack against
+// the first character of the needle, and the block shifted by the needle
+// length against its last character. Only positions where both characters
+// match are compared in full.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VEC_SIZE 32
+typedef __m256i vec;
+#define vec_set1(c) _mm256_set1_epi8(c)
+#define vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_and(a, b) _mm256_and_si256(a, b)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_mask(a) (uint32_t)_mm256_movemask_epi8(a)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VEC_SIZE 16
+typedef __m128i vec;
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_and(a, b) _mm_and_si128(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_mask(a) (uint32_t)_mm_movemask_epi8(a)
+#endif
+
+// Returns the bits to set on a character so that it compares equal to the
+// folded character c if and only if it folds to c.
+static inline char fold_bits(char c) {
+	return 'a' <= c && c <= 'z' ? 0x20 : 0;
+}
+
+static bool equal_fold(const char *s1, const char *s2, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		if (fold(s1[i]) != fold(s2[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Returns a pointer to the first occurrence of needle in haystack, or NULL.
+const char *search(const char *haystack, size_t haystack_len,
+		const char *needle, size_t needle_len) {
+	if (needle_len == 0) {
+		return haystack;
+	}
+	if (needle_len > haystack_len) {
+		return NULL;
+	}
+	if (needle_len == 1) {
+		return memchr(haystack, needle[0], haystack_len);
+	}
+
+	size_t i = 0;
+	size_t last = needle_len - 1;
+#ifdef VEC_SIZE
+	vec first_char = vec_set1(needle[0]);
+	vec last_char = vec_set1(needle[last]);
+	for (; i + last + VEC_SIZE <= haystack_len; i += VEC_SIZE) {
+		vec first_block = vec_load(haystack + i);
+		vec last_block = vec_load(haystack + i + last);
+		uint32_t mask = vec_mask(vec_and(vec_eq(first_block, first_char),
+				vec_eq(last_block, last_char)));
+		while (mask) {
+			const char *s = haystack + i + __builtin_ctz(mask);
+			if (memcmp(s + 1, needle + 1, last - 1) == 0) {
+				return s;
+			}
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	const char *end = haystack + haystack_len - last;
+	for (const char *s = haystack + i; s < end; s++) {
+		s = memchr(s, needle[0], end - s);
+		if (!s) {
+			break;
+		}
+		if (s[last] == needle[last] && memcmp(s + 1, needle + 1, last - 1) == 0) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+// Like search, but ASCII letters are compared case-insensitively.
+const char *search_fold(const char *haystack, size_t haystack_len,
+		const char *needle, size_t needle_len) {
+	if (needle_len == 0) {
+		return haystack;
+	}
+	if (needle_len > haystack_len) {
+		return NULL;
+	}
+
+	size_t i = 0;
+	size_t last = needle_len - 1;
+	char first = fold(needle[0]);
+	char final = fold(needle[last]);
+#ifdef VEC_SIZE
+	vec first_char = vec_set1(first);
+	vec first_bits = vec_set1(fold_bits(first));
+	vec last_char = vec_set1(final);
+	vec last_bits = vec_set1(fold_bits(final));
+	for (; i + last + VEC_SIZE <= haystack_len; i += VEC_SIZE) {
+		vec first_block = vec_or(vec_load(haystack + i), first_bits);
+		vec last_block = vec_or(vec_load(haystack + i + last), last_bits);
+		uint32_t mask = vec_mask(vec_and(vec_eq(first_block, first_char),
+				vec_eq(last_block, last_char)));
+		while (mask) {
+			const char *s = haystack + i + __builtin_ctz(mask);
+			if (equal_fold(s + 1, needle + 1, last)) {
+				return s;
+			}
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for (; i + last < haystack_len; i++) {
+		const char *s = haystack + i;
+		if (fold(s[0]) == first && fold(s[last]) == final
+				&& equal_fold(s + 1, needle + 1, last)) {
+			return s;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,15 @@
+#ifndef WMENU_SEARCH_H
+#define WMENU_SEARCH_H
+
+#include <stddef.h>
+
+static inline char fold(char c) {
+	return 'A' <= c && c <= 'Z' ? c | 0x20 : c;
+}
+
+const char *search(const char *haystack, size_t haystack_len,
+		const char *needle, size_t needle_len);
+const char *search_fold(const char *haystack, size_t haystack_len,
+		const char *needle, size_t needle_len);
+
+#endif
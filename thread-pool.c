@@ -0,0 +1,105 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "thread-pool.h"
+
+// Worker threads which run the jobs of a batch along with the thread which
+// hands it out. Workers are started as batches need them, and then wait for
+// the next batch. Batches run one at a time, so that the matching thread and
+// the event thread can share the workers.
+struct thread_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;     // signaled when a batch is handed out
+	pthread_cond_t done;     // signaled when a batch or its last job is done
+	size_t workers;          // number of workers started
+	bool busy;               // whether a batch is running
+	void (*run)(void *job);
+	char *jobs;              // jobs of the running batch
+	size_t size;             // size of each job
+	size_t njobs;
+	size_t next;             // next job to be taken
+	size_t running;          // jobs not yet done
+};
+
+// Takes the next job of the batch and runs it, with the pool locked. Returns
+// false if every job is taken.
+static bool run_job(struct thread_pool *pool) {
+	if (pool->next >= pool->njobs) {
+		return false;
+	}
+	void *job = pool->jobs + pool->next++ * pool->size;
+	pthread_mutex_unlock(&pool->lock);
+	pool->run(job);
+	pthread_mutex_lock(&pool->lock);
+	if (--pool->running == 0) {
+		pthread_cond_broadcast(&pool->done);
+	}
+	return true;
+}
+
+static void *run_worker(void *data) {
+	struct thread_pool *pool = data;
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		if (!run_job(pool)) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+	}
+	return NULL;
+}
+
+struct thread_pool *thread_pool_create(void) {
+	struct thread_pool *pool = calloc(1, sizeof *pool);
+	if (!pool) {
+		fprintf(stderr, "could not calloc %zu bytes", sizeof *pool);
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	return pool;
+}
+
+// Runs each of the jobs, which are size bytes apart, on the workers and the
+// calling thread, and waits for them. A worker is started for each job but
+// one if needed. Jobs are still run by the calling thread if no worker can be
+// started.
+void thread_pool_run(struct thread_pool *pool, void (*run)(void *job),
+		void *jobs, size_t size, size_t njobs) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	for (; pool->workers + 1 < njobs; pool->workers++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, run_worker, pool) != 0) {
+			break;
+		}
+		pthread_detach(thread);
+	}
+
+	pool->busy = true;
+	pool->run = run;
+	pool->jobs = jobs;
+	pool->size = size;
+	pool->njobs = njobs;
+	pool->next = 0;
+	pool->running = njobs;
+	if (njobs > 1) {
+		pthread_cond_broadcast(&pool->work);
+	}
+	while (run_job(pool)) {
+		/* take a share of the jobs */
+	}
+	while (pool->running > 0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+
+	pool->busy = false;
+	pool->jobs = NULL;
+	pool->njobs = 0;
+	pthread_cond_broadcast(&pool->done);
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,12 @@
+#ifndef WMENU_THREAD_POOL_H
+#define WMENU_THREAD_POOL_H
+
+#include <stddef.h>
+
+struct thread_pool;
+
+struct thread_pool *thread_pool_create(void);
+void thread_pool_run(struct thread_pool *pool, void (*run)(void *job),
+		void *jobs, size_t size, size_t njobs);
+
+#endif
@@ -0,0 +1,195 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trigram.h"
+
+#include "search.h"
+
+#define TRIGRAM_BITS 18
+#define TRIGRAM_BUCKETS (1 << TRIGRAM_BITS)
+
+// An inverted index from the case-folded trigrams of the item texts to the
+// items containing them. Trigrams are hashed into buckets, so a posting list
+// may contain items which only contain another trigram of the same bucket.
+struct trigram_index {
+	char **texts;
+	uint32_t *lens; // lengths of the texts, which need not be NUL-terminated
+	size_t len;
+
+	size_t *offsets;    // start of the posting list of each bucket
+	uint32_t *postings; // ascending indices of the items in each bucket
+
+	atomic_bool ready;
+};
+
+// A posting list.
+struct postings {
+	const uint32_t *items;
+	size_t len;
+};
+
+static uint32_t trigram_bucket(const char *s) {
+	uint32_t trigram = (uint32_t)(unsigned char)fold(s[0]) << 16
+		| (uint32_t)(unsigned char)fold(s[1]) << 8
+		| (uint32_t)(unsigned char)fold(s[2]);
+	return (trigram * 2654435761u) >> (32 - TRIGRAM_BITS);
+}
+
+static void *build_index(void *data) {
+	struct trigram_index *index = data;
+
+	// The last item added to each bucket, plus one
+	uint32_t *last = calloc(TRIGRAM_BUCKETS, sizeof *last);
+	index->offsets = calloc(TRIGRAM_BUCKETS + 1, sizeof *index->offsets);
+	if (!last || !index->offsets) {
+		goto cleanup;
+	}
+
+	// Count the items in each bucket
+	for (uint32_t i = 0; i < index->len; i++) {
+		const char *text = index->texts[i];
+		for (size_t j = 0; j + 2 < index->lens[i]; j++) {
+			uint32_t bucket = trigram_bucket(text + j);
+			if (last[bucket] != i + 1) {
+				last[bucket] = i + 1;
+				index->offsets[bucket + 1]++;
+			}
+		}
+	}
+	for (size_t b = 0; b < TRIGRAM_BUCKETS; b++) {
+		index->offsets[b + 1] += index->offsets[b];
+	}
+
+	size_t npostings = index->offsets[TRIGRAM_BUCKETS];
+	index->postings = malloc((npostings > 0 ? npostings : 1)
+			* sizeof *index->postings);
+	if (!index->postings) {
+		goto cleanup;
+	}
+
+	// Fill in the posting lists, using the offsets as cursors
+	memset(last, 0, TRIGRAM_BUCKETS * sizeof *last);
+	for (uint32_t i = 0; i < index->len; i++) {
+		const char *text = index->texts[i];
+		for (size_t j = 0; j + 2 < index->lens[i]; j++) {
+			uint32_t bucket = trigram_bucket(text + j);
+			if (last[bucket] != i + 1) {
+				last[bucket] = i + 1;
+				index->postings[index->offsets[bucket]++] = i;
+			}
+		}
+	}
+	memmove(index->offsets + 1, index->offsets, TRIGRAM_BUCKETS * sizeof *index->offsets);
+	index->offsets[0] = 0;
+
+	atomic_store(&index->ready, true);
+
+cleanup:
+	free(last);
+	return NULL;
+}
+
+// Creates an index of the given item texts. The index is built on a detached
+// thread if possible, so that exiting is not held up by it, and can be used
+// once it is ready.
+struct trigram_index *trigram_index_create(char **texts, uint32_t *lens,
+		size_t len) {
+	if (len >= UINT32_MAX) {
+		return NULL;
+	}
+	struct trigram_index *index = calloc(1, sizeof *index);
+	if (!index) {
+		return NULL;
+	}
+	index->texts = texts;
+	index->lens = lens;
+	index->len = len;
+	atomic_init(&index->ready, false);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, build_index, index) == 0) {
+		pthread_detach(thread);
+	} else {
+		build_index(index);
+	}
+	return index;
+}
+
+bool trigram_index_ready(struct trigram_index *index) {
+	return atomic_load(&index->ready);
+}
+
+static int compare_postings(const void *a, const void *b) {
+	const struct postings *pa = a, *pb = b;
+	return (pa->len > pb->len) - (pa->len < pb->len);
+}
+
+// Returns the first position in the list not less than the item.
+static size_t lower_bound(const uint32_t *list, size_t len, uint32_t item) {
+	size_t lo = 0, hi = len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (list[mid] < item) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Narrows down the candidates to the items which may contain the string, and
+// returns whether the index could be used for it. If there are no candidates
+// yet, they are allocated and set to every item which may contain the string.
+// Candidates are item indices in ascending order.
+bool trigram_index_narrow(struct trigram_index *index, const char *s, size_t len,
+		uint32_t **candidates, size_t *ncandidates) {
+	if (len < 3) {
+		return false;
+	}
+
+	size_t nlists = len - 2;
+	struct postings *lists = malloc(nlists * sizeof *lists);
+	if (!lists) {
+		return false;
+	}
+	for (size_t i = 0; i < nlists; i++) {
+		uint32_t bucket = trigram_bucket(s + i);
+		lists[i].items = index->postings + index->offsets[bucket];
+		lists[i].len = index->offsets[bucket + 1] - index->offsets[bucket];
+	}
+
+	// Intersect the shortest lists first
+	qsort(lists, nlists, sizeof *lists, compare_postings);
+	size_t i = 0;
+	if (!*candidates) {
+		*candidates = malloc((lists[0].len > 0 ? lists[0].len : 1)
+				* sizeof **candidates);
+		if (!*candidates) {
+			free(lists);
+			return false;
+		}
+		memcpy(*candidates, lists[0].items, lists[0].len * sizeof **candidates);
+		*ncandidates = lists[0].len;
+		i++;
+	}
+	for (; i < nlists && *ncandidates > 0; i++) {
+		size_t n = 0, pos = 0;
+		for (size_t j = 0; j < *ncandidates; j++) {
+			uint32_t item = (*candidates)[j];
+			pos += lower_bound(lists[i].items + pos, lists[i].len - pos, item);
+			if (pos < lists[i].len && lists[i].items[pos] == item) {
+				(*candidates)[n++] = item;
+			}
+		}
+		*ncandidates = n;
+	}
+
+	free(lists);
+	return true;
+}
@@ -0,0 +1,14 @@
+#ifndef WMENU_TRIGRAM_H
+#define WMENU_TRIGRAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct trigram_index *trigram_index_create(char **texts, uint32_t *lens,
+		size_t len);
+bool trigram_index_ready(struct trigram_index *index);
+bool trigram_index_narrow(struct trigram_index *index, const char *s, size_t len,
+		uint32_t **candidates, size_t *ncandidates);
+
+#endif
@@ -0,0 +1,175 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "width-cache.h"
+
+// Number of widths kept in the cache file
+#ifndef WIDTH_CACHE_ENTRIES
+#define WIDTH_CACHE_ENTRIES (1 << 18)
+#endif
+
+// Number of slots probed for an entry
+#define WIDTH_CACHE_PROBES 8
+
+// Identifies the format of the cache file
+#define WIDTH_CACHE_MAGIC 0x3168746469776d77ull
+
+// Bits of each slot which hold the width
+#define WIDTH_BITS 24
+#define WIDTH_MASK ((1ull << WIDTH_BITS) - 1)
+
+// A cache of text widths, kept in a file shared by every instance. Each slot
+// holds the upper bits of the hash of the font identity and text along with
+// the width plus one, so that slots are read and written at once without locking.
+// Empty slots are zero. Widths are measured at scale 1, so the scale is not
+// part of the hash.
+struct width_cache {
+	_Atomic uint64_t *slots;
+	uint64_t seed; // hash of the font identity
+};
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ p[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+// Opens the cache file, creating its directories if needed.
+static int open_cache_file(void) {
+	char path[PATH_MAX];
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int n;
+	if (cache_home && cache_home[0] == '/') {
+		n = snprintf(path, sizeof path, "%s", cache_home);
+	} else if (home) {
+		n = snprintf(path, sizeof path, "%s/.cache", home);
+	} else {
+		return -1;
+	}
+
+	const char *names[] = { "", "/wmenu", "/widths" };
+	for (size_t i = 0; i < sizeof names / sizeof *names; i++) {
+		if (n < 0 || (size_t)n + strlen(names[i]) >= sizeof path) {
+			return -1;
+		}
+		strcpy(path + n, names[i]);
+		n += strlen(names[i]);
+		if (i < 2 && mkdir(path, 0700) == -1 && errno != EEXIST) {
+			return -1;
+		}
+	}
+	return open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+}
+
+// Clears the cache file and writes the magic number, unless it already has
+// the expected size and format. The file is locked meanwhile, so that other
+// instances do not clear it while it is being set up.
+static bool init_cache_file(int fd, size_t size) {
+	struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	if (fcntl(fd, F_SETLKW, &lock) == -1) {
+		return false;
+	}
+	struct stat st;
+	uint64_t magic = 0;
+	if (fstat(fd, &st) == -1) {
+		return false;
+	}
+	if ((size_t)st.st_size == size
+			&& pread(fd, &magic, sizeof magic, 0) == sizeof magic
+			&& magic == WIDTH_CACHE_MAGIC) {
+		return true;
+	}
+	magic = WIDTH_CACHE_MAGIC;
+	return ftruncate(fd, 0) == 0 && ftruncate(fd, size) == 0
+		&& pwrite(fd, &magic, sizeof magic, 0) == sizeof magic;
+}
+
+// Opens the cache of widths measured with the font of the given identity, which
+// changes along with the font it resolves to, or returns NULL if it cannot be
+// used. A file of another size or format is reinitialized.
+struct width_cache *width_cache_open(const char *identity) {
+	size_t size = sizeof(uint64_t) + WIDTH_CACHE_ENTRIES * sizeof(uint64_t);
+	int fd = open_cache_file();
+	if (fd == -1) {
+		return NULL;
+	}
+	if (!init_cache_file(fd, size)) {
+		close(fd);
+		return NULL;
+	}
+	/* closing the file releases the lock */
+	uint64_t *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
+
+	struct width_cache *cache = calloc(1, sizeof *cache);
+	if (!cache) {
+		munmap(data, size);
+		return NULL;
+	}
+	cache->slots = (_Atomic uint64_t *)(data + 1);
+	cache->seed = hash_bytes(0xcbf29ce484222325ull, identity,
+			strlen(identity) + 1);
+	return cache;
+}
+
+// Looks up the width of the first len bytes of the text, and returns whether
+// it was found.
+bool width_cache_get(struct width_cache *cache, const char *text, int len,
+		int *width) {
+	if (!cache) {
+		return false;
+	}
+	uint64_t hash = hash_bytes(cache->seed, text, len);
+	for (size_t i = 0; i < WIDTH_CACHE_PROBES; i++) {
+		size_t index = (hash + i) & (WIDTH_CACHE_ENTRIES - 1);
+		uint64_t slot = atomic_load_explicit(&cache->slots[index],
+				memory_order_relaxed);
+		if (slot == 0) {
+			return false;
+		}
+		if ((slot & ~WIDTH_MASK) == (hash & ~WIDTH_MASK)) {
+			*width = (int)(slot & WIDTH_MASK) - 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Stores the width of the first len bytes of the text, replacing another
+// entry if there is no free slot for it.
+void width_cache_put(struct width_cache *cache, const char *text, int len,
+		int width) {
+	if (!cache || width < 0 || (uint64_t)width >= WIDTH_MASK) {
+		return;
+	}
+	uint64_t hash = hash_bytes(cache->seed, text, len);
+	uint64_t entry = (hash & ~WIDTH_MASK) | (uint64_t)(width + 1);
+	size_t index = hash & (WIDTH_CACHE_ENTRIES - 1);
+	for (size_t i = 0; i < WIDTH_CACHE_PROBES; i++) {
+		size_t probe = (hash + i) & (WIDTH_CACHE_ENTRIES - 1);
+		uint64_t slot = atomic_load_explicit(&cache->slots[probe],
+				memory_order_relaxed);
+		if (slot == 0 || (slot & ~WIDTH_MASK) == (hash & ~WIDTH_MASK)) {
+			index = probe;
+			break;
+		}
+	}
+	atomic_store_explicit(&cache->slots[index], entry, memory_order_relaxed);
+}
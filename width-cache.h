@@ -0,0 +1,14 @@
+#ifndef WMENU_WIDTH_CACHE_H
+#define WMENU_WIDTH_CACHE_H
+
+#include <stdbool.h>
+
+struct width_cache;
+
+struct width_cache *width_cache_open(const char *identity);
+bool width_cache_get(struct width_cache *cache, const char *text, int len,
+		int *width);
+void width_cache_put(struct width_cache *cache, const char *text, int len,
+		int width);
+
+#endif